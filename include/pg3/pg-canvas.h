@@ -2,6 +2,7 @@ typedef struct Pg           Pg;
 typedef struct PgTM         PgTM;
 typedef enum PgLineCap      PgLineCap;
 typedef enum PgFillRule     PgFillRule;
+typedef void                PgPixelsCallback(void *data, const uint8_t *pixels, unsigned width, unsigned height);
 
 struct PgTM {
     float a;
@@ -24,14 +25,32 @@ enum PgFillRule {
 
 
 Pg*         pg_canvas_new_opengl(unsigned width, unsigned height);
+Pg*         pg_canvas_new_image(unsigned width, unsigned height, uint8_t *optional_pixels);
 Pg*         pg_canvas_new_subcanvas(Pg *parent, float x, float y, float sx, float sy);
+Pg*         pg_canvas_new_layer(Pg *parent, unsigned width, unsigned height);
+Pg*         pg_canvas_new_offscreen(unsigned width, unsigned height);
 
 void        pg_canvas_free(Pg *g);
 
+uint8_t*    pg_canvas_get_image_pixels(Pg *g);
+void        pg_canvas_set_glyph_cache(Pg *g, unsigned size);
+void        pg_canvas_set_path_cache(Pg *g, size_t max_bytes);
+void        pg_canvas_set_implicit_curves(Pg *g, bool implicit);
+void        pg_canvas_set_analytic_antialias(Pg *g, bool analytic);
+void        pg_canvas_set_redraw_region(Pg *g, float x, float y, float sx, float sy);
+unsigned    pg_canvas_get_path_cache_hits(Pg *g);
+unsigned    pg_canvas_get_path_cache_misses(Pg *g);
+PgPt        pg_canvas_get_damage_start(Pg *g);
+PgPt        pg_canvas_get_damage_size(Pg *g);
+bool        pg_canvas_read_pixels(Pg *g, float x, float y, float sx, float sy, uint8_t *pixels);
+bool        pg_canvas_read_pixels_async(Pg *g, float x, float y, float sx, float sy, PgPixelsCallback *callback, void *data);
+
 void        pg_canvas_clear(Pg *g);
 void        pg_canvas_fill(Pg *g);
 void        pg_canvas_stroke(Pg *g);
 void        pg_canvas_fill_stroke(Pg *g);
+void        pg_canvas_fill_instances(Pg *g, const PgPath *path, const PgTM *xforms, const PgPaint **paints, unsigned n);
+void        pg_canvas_draw_layer(Pg *g, Pg *layer, float opacity);
 void        pg_canvas_commit(Pg *g);
 
 float       pg_canvas_printf(Pg *g, PgFont *font, float x, float y, const char *str, ...);
@@ -103,6 +122,7 @@ float           pg_canvas_get_scissor_start_y(Pg *g);
 float           pg_canvas_get_scissor_size_x(Pg *g);
 float           pg_canvas_get_scissor_size_y(Pg *g);
 bool            pg_canvas_get_underline(Pg *g);
+unsigned        pg_canvas_get_culled_paths(Pg *g);
 
 PgPt        pg_mat_apply(PgTM ctm, PgPt p);
 PgTM        pg_mat_multiply(PgTM x, PgTM y);
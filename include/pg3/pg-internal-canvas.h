@@ -1,3 +1,6 @@
+// Joins longer than this many half line widths are bevelled.
+#define PG_MITER_LIMIT      10.0f
+
 typedef struct PgCanvasFunc PgCanvasFunc;
 typedef struct PgState      PgState;
 
@@ -28,6 +31,7 @@ struct Pg {
     PgPath              *path;
     PgState             s;
     PgState             *saved;
+    unsigned            culled;     // Paths outside the scissor.
 };
 
 struct PgCanvasFunc {
@@ -38,6 +42,8 @@ struct PgCanvasFunc {
     void    (*fill_stroke)(Pg *g);
     PgPt    (*set_size)(Pg *g, float width, float height);
     void    (*free)(Pg *g);
+    bool    (*show_glyph)(Pg *g, PgFont *font, float x, float y, unsigned glyph);
+    bool    (*fill_instances)(Pg *g, const PgPath *path, const PgTM *xforms, const PgPaint **paints, unsigned n);
 };
 
 Pg _pg_canvas_init(const PgCanvasFunc *v, float width, float height);
@@ -5,6 +5,7 @@ struct PgFont {
     const uint8_t       *data;
     size_t              size;
     unsigned            index;
+    unsigned            serial;     // Never reused, so caches can key on it.
 
     float               sx;
     float               sy;
@@ -1,5 +1,7 @@
 void*       _pg_file_map(const char *path, size_t *sizep);
 void        _pg_file_unmap(void *ptr, size_t size);
+bool        _pg_file_save(const char *path, const void *data, size_t size);
+char*       _pg_cache_path(const char *name);
 
 unsigned    _pg_default_font_dirs(char **queue, unsigned max);
 
@@ -88,6 +88,7 @@ const char* pg_window_get_title(PgWindow *win);
 void        pg_window_set_title(PgWindow *win, const char *title);
 void        pg_window_update(PgWindow *win);
 void        pg_window_queue_update(PgWindow *win);
+void        pg_window_queue_update_region(PgWindow *win, float x, float y, float sx, float sy);
 void        pg_window_queue_dummy(PgWindow *win);
 
 PgWindowEvent*  pg_window_event_wait(void);
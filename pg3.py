@@ -1,8 +1,9 @@
 # TODO:
 # Fix functions that send or return PgPt or PgTM
 
+import math
 import sys
-from ctypes import cdll, c_bool, c_int, c_uint, c_float, c_char_p, c_void_p, c_size_t, Structure, Union, POINTER, pointer
+from ctypes import cdll, CFUNCTYPE, create_string_buffer, c_bool, c_int, c_uint, c_float, c_char_p, c_void_p, c_size_t, Structure, Union, POINTER, pointer
 
 pg3 = cdll.LoadLibrary('./libpg3.so')
 module = sys.modules[__name__]
@@ -59,6 +60,7 @@ func('pg_window_get_width', c_float, win=PgWindow)
 func('pg_window_get_height', c_float, win=PgWindow)
 func('pg_window_update', None, win=PgWindow)
 func('pg_window_queue_update', None, win=PgWindow)
+func('pg_window_queue_update_region', None, win=PgWindow, x=c_float, y=c_float, sx=c_float, sy=c_float)
 func('pg_window_event_wait', c_void_p)
 
 func('pg_window_event_get_type', PgWindowEventType, e=PgWindowEvent)
@@ -239,15 +241,35 @@ enum('PgFillRule',
     'PG_EVEN_ODD_RULE',
 )
 
+PgPixelsCallback = CFUNCTYPE(None, c_void_p, c_void_p, c_uint, c_uint)
+
 func('pg_canvas_new_opengl', Pg, width=c_uint, height=c_uint)
+func('pg_canvas_new_image', Pg, width=c_uint, height=c_uint, optional_pixels=c_void_p)
 func('pg_canvas_new_subcanvas', Pg, parent=Pg, x=c_float, y=c_float, sx=c_float, sy=c_float)
+func('pg_canvas_new_layer', Pg, parent=Pg, width=c_uint, height=c_uint)
+func('pg_canvas_new_offscreen', Pg, width=c_uint, height=c_uint)
 
 func('pg_canvas_free', None, g=Pg)
 
+func('pg_canvas_get_image_pixels', c_void_p, g=Pg)
+func('pg_canvas_set_glyph_cache', None, g=Pg, size=c_uint)
+func('pg_canvas_set_path_cache', None, g=Pg, max_bytes=c_size_t)
+func('pg_canvas_set_implicit_curves', None, g=Pg, implicit=c_bool)
+func('pg_canvas_set_analytic_antialias', None, g=Pg, analytic=c_bool)
+func('pg_canvas_set_redraw_region', None, g=Pg, x=c_float, y=c_float, sx=c_float, sy=c_float)
+func('pg_canvas_get_path_cache_hits', c_uint, g=Pg)
+func('pg_canvas_get_path_cache_misses', c_uint, g=Pg)
+func('pg_canvas_get_damage_start', PgPt, g=Pg)
+func('pg_canvas_get_damage_size', PgPt, g=Pg)
+func('pg_canvas_read_pixels', c_bool, g=Pg, x=c_float, y=c_float, sx=c_float, sy=c_float, pixels=c_void_p)
+func('pg_canvas_read_pixels_async', c_bool, g=Pg, x=c_float, y=c_float, sx=c_float, sy=c_float, callback=PgPixelsCallback, data=c_void_p)
+
 func('pg_canvas_clear', None, g=Pg)
 func('pg_canvas_fill', None, g=Pg)
 func('pg_canvas_stroke', None, g=Pg)
 func('pg_canvas_fill_stroke', None, g=Pg)
+func('pg_canvas_fill_instances', None, g=Pg, path=PgPath, xforms=POINTER(PgTM), paints=POINTER(PgPaint), n=c_uint)
+func('pg_canvas_draw_layer', None, g=Pg, layer=Pg, opacity=c_float)
 func('pg_canvas_commit', None, g=Pg)
 
 func('pg_canvas_show_char', c_float, g=Pg, font=PgFont, x=c_float, y=c_float, codepoint=c_uint)
@@ -317,6 +339,7 @@ func('pg_canvas_get_scissor_start_y', c_float, g=Pg)
 func('pg_canvas_get_scissor_size_x', c_float, g=Pg)
 func('pg_canvas_get_scissor_size_y', c_float, g=Pg)
 func('pg_canvas_get_underline', c_bool, g=Pg)
+func('pg_canvas_get_culled_paths', c_uint, g=Pg)
 
 # func('pg_mat_apply', PgPt, ctm=PgTM, p=PgPt)
 func('pg_mat_multiply', PgTM, x=PgTM, y=PgTM)
@@ -429,6 +452,10 @@ class Window:
         "Notify the window system to send an update event."
         pg_window_queue_update(self.native)
 
+    def queue_update_region(self, x, y, sx, sy):
+        "Notify the window system to send an update event for part of the window."
+        pg_window_queue_update_region(self.native, x, y, sx, sy)
+
     def wait_event():
         "Wait for an event."
         e = pg_window_event_wait()
@@ -444,6 +471,10 @@ class Canvas:
     def from_native(native):
         return Canvas(native) if native else None
 
+    def offscreen(width, height):
+        "Create a canvas that draws without a window."
+        return Canvas.from_native(pg_canvas_new_offscreen(width, height))
+
     @property
     def width(self):
         return pg_canvas_get_width(self.native)
@@ -459,6 +490,21 @@ class Canvas:
     def subcanvas(self, x, y, sx, sy):
         return Canvas.from_native(pg_canvas_new_subcanvas(self.native, x, y, sx, sy))
 
+    def layer(self, width, height):
+        return Canvas.from_native(pg_canvas_new_layer(self.native, width, height))
+
+    def draw_layer(self, layer, opacity=1.0):
+        pg_canvas_draw_layer(self.native, layer.native, opacity)
+
+    def read_pixels(self, x, y, sx, sy):
+        "Read part of the canvas as RGBA rows from the top down."
+        width = math.ceil(x + sx) - math.floor(x)
+        height = math.ceil(y + sy) - math.floor(y)
+        pixels = create_string_buffer(max(width * height * 4, 1))
+        if pg_canvas_read_pixels(self.native, x, y, sx, sy, pixels):
+            return pixels.raw
+        return None
+
     def free(self):
         pg_canvas_free(self.native)
 
@@ -678,6 +724,9 @@ class Canvas:
     def get_underline(self):
         return pg_canvas_get_underline(self.native)
 
+    def get_culled_paths(self):
+        return pg_canvas_get_culled_paths(self.native)
+
 
 
 class Font:
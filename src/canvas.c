@@ -235,6 +235,60 @@ pg_canvas_commit(Pg *g)
 }
 
 
+/*
+    Whether the path lies wholly outside the scissor and the canvas,
+    going by the bounds of its points under the CTM, which contain the
+    curves between them. Strokes are widened by the longest mitre,
+    which also covers square caps. A pixel more is allowed for
+    antialiasing.
+*/
+static bool
+culled(Pg *g, bool stroked)
+{
+    PgTM    ctm = g->s.ctm;
+    PgPt    min = pgpt(INFINITY, INFINITY);
+    PgPt    max = pgpt(-INFINITY, -INFINITY);
+
+    for (unsigned i = 0; i < g->path->nparts; i++) {
+        PgPart      *part = g->path->parts + i;
+        unsigned    npts = part->type == PG_PART_CURVE4? 3:
+                           part->type == PG_PART_CURVE3? 2:
+                           part->type == PG_PART_CLOSE? 0:
+                           1;
+
+        for (unsigned j = 0; j < npts; j++) {
+            PgPt p = pg_mat_apply(ctm, part->pt[j]);
+            min = pgpt(fminf(min.x, p.x), fminf(min.y, p.y));
+            max = pgpt(fmaxf(max.x, p.x), fmaxf(max.y, p.y));
+        }
+    }
+
+    // Leave empty paths to the canvas.
+    if (min.x > max.x)
+        return false;
+
+    float   pad = 1.0f;
+
+    if (stroked) {
+        float reach = 0.5f * g->s.line_width * PG_MITER_LIMIT;
+        pad += reach * fmaxf(fabsf(ctm.a) + fabsf(ctm.c), fabsf(ctm.b) + fabsf(ctm.d));
+    }
+
+    float   x0 = fmaxf(0.0f, g->s.clip_x);
+    float   y0 = fmaxf(0.0f, g->s.clip_y);
+    float   x1 = fminf(g->sx, g->s.clip_x + g->s.clip_sx);
+    float   y1 = fminf(g->sy, g->s.clip_y + g->s.clip_sy);
+
+    if (max.x + pad <= x0 || min.x - pad >= x1 ||
+        max.y + pad <= y0 || min.y - pad >= y1)
+    {
+        g->culled++;
+        return true;
+    }
+    return false;
+}
+
+
 void
 pg_canvas_clear(Pg *g)
 {
@@ -263,7 +317,8 @@ pg_canvas_fill(Pg *g)
     if (!g->s.fill)
         return;
 
-    g->v->fill(g);
+    if (!culled(g, false))
+        g->v->fill(g);
     pg_canvas_path_clear(g);
 }
 
@@ -280,7 +335,8 @@ pg_canvas_stroke(Pg *g)
     if (!g->s.stroke)
         return;
 
-    g->v->stroke(g);
+    if (!culled(g, true))
+        g->v->stroke(g);
     pg_canvas_path_clear(g);
 }
 
@@ -300,11 +356,59 @@ pg_canvas_fill_stroke(Pg *g)
     if (!g->s.stroke)
         return;
 
-    g->v->fill_stroke(g);
+    if (!culled(g, true))
+        g->v->fill_stroke(g);
     pg_canvas_path_clear(g);
 }
 
 
+/*
+    Fill copies of a path, each with the CTM multiplied by its own
+    transform and in its own paint. The fill paint is used where
+    `paints` or its entry is null. The current path is left alone.
+*/
+void
+pg_canvas_fill_instances(Pg *g,
+                         const PgPath *path,
+                         const PgTM *xforms,
+                         const PgPaint **paints,
+                         unsigned n)
+{
+    if (!g || !path || !xforms)
+        return;
+
+    if (!g->v || !g->v->fill)
+        return;
+
+    if (g->v->fill_instances && g->v->fill_instances(g, path, xforms, paints, n))
+        return;
+
+    // Otherwise fill each copy in turn.
+    PgPath          *old_path = g->path;
+    PgTM            ctm = g->s.ctm;
+    const PgPaint   *fill = g->s.fill;
+
+    g->path = pg_path_new();
+
+    for (unsigned i = 0; i < n; i++) {
+        g->s.ctm = pg_mat_multiply(ctm, xforms[i]);
+        g->s.fill = paints && paints[i]? paints[i]: fill;
+
+        if (g->s.fill) {
+            pg_path_reset(g->path);
+            pg_path_append(g->path, path);
+            if (!culled(g, false))
+                g->v->fill(g);
+        }
+    }
+
+    pg_path_free(g->path);
+    g->path = old_path;
+    g->s.ctm = ctm;
+    g->s.fill = fill;
+}
+
+
 void
 pg_canvas_close_path(Pg *g)
 {
@@ -710,3 +814,16 @@ pg_canvas_get_underline(Pg *g)
     return g->s.underline;
 }
 
+
+/*
+    Count the paths that were not drawn because they were wholly outside
+    the scissor.
+*/
+unsigned
+pg_canvas_get_culled_paths(Pg *g)
+{
+    if (!g)
+        return 0;
+    return g->culled;
+}
+
@@ -0,0 +1,483 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pg3/pg.h>
+#include <pg3/pg-internal-canvas.h>
+#include "help.geometry.h"
+#include "help.flatten.h"
+#include "help.paint.h"
+
+#define IMAGE(G)        ((Image*) (G))
+#define RAMP_SIZE       256
+
+/*
+    Software canvas.
+    Paths are rasterised with exact area coverage: each edge adds its
+    signed area to an accumulation buffer and a running sum along each
+    row gives the winding number of every pixel, fractional at edges.
+    Pixels are RGBA with 8 bits per channel, not premultiplied.
+*/
+
+typedef struct {
+    Pg          _;
+    uint8_t     *pixels;
+    bool        owned;
+    float       *acc;
+    unsigned    stride;
+    int         miny;
+    int         maxy;
+    Scratch     scratch;
+} Image;
+
+static const PgCanvasFunc methods;
+
+
+
+static inline float
+clamp01(float x)
+{
+    return x < 0.0f? 0.0f: x > 1.0f? 1.0f: x;
+}
+
+
+static inline PgColor
+convert(const PgPaint *paint, PgColor color, float gamma)
+{
+    PgColor c = pg_color_to_rgb(paint->cspace, color, gamma);
+    return (PgColor) { clamp01(c.u), clamp01(c.v), clamp01(c.w), clamp01(c.a) };
+}
+
+
+/*
+    Evaluate a paint into `ramp`.
+    Solid paints fill the first entry only.
+    Gradients are sampled at `RAMP_SIZE` points so that colour conversion
+    happens once per entry instead of once per pixel.
+*/
+static void
+make_ramp(Pg *g, const PgPaint *paint, PgColor *ramp)
+{
+    if (paint->nstops == 1 || paint->type == PG_SOLID_PAINT) {
+        ramp[0] = convert(paint, paint->colors[0], g->s.gamma);
+        return;
+    }
+
+    for (unsigned i = 0; i < RAMP_SIZE; i++)
+        ramp[i] = convert(paint,
+                          stopcolor(paint, i / (RAMP_SIZE - 1.0f)),
+                          g->s.gamma);
+}
+
+
+static inline PgColor
+paint_at(const PgPaint *paint, const PgColor *ramp, float x, float y)
+{
+    if (paint->nstops == 1 || paint->type == PG_SOLID_PAINT)
+        return ramp[0];
+
+    PgPt    dv = sub(paint->b, paint->a);
+    PgPt    dp = sub(pgpt(x, y), paint->a);
+    float   dd = dot(dv, dv);
+    float   t = dd == 0.0f? 0.0f: dot(dv, dp) / dd;
+
+    return ramp[(unsigned) (clamp01(t) * (RAMP_SIZE - 1) + 0.5f)];
+}
+
+
+static inline void
+blend(uint8_t *px, PgColor c, float coverage)
+{
+    float   a = c.a * coverage;
+    float   ia = 1.0f - a;
+
+    px[0] = (uint8_t) (255.0f * (c.u * a + px[0] / 255.0f * ia) + 0.5f);
+    px[1] = (uint8_t) (255.0f * (c.v * a + px[1] / 255.0f * ia) + 0.5f);
+    px[2] = (uint8_t) (255.0f * (c.w * a + px[2] / 255.0f * ia) + 0.5f);
+    px[3] = (uint8_t) (255.0f * (c.a * a + px[3] / 255.0f * ia) + 0.5f);
+}
+
+
+// Intersect the scissor with the canvas.
+static void
+clip_rect(Pg *g, int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = (int) fmaxf(0.0f, g->s.clip_x);
+    *y0 = (int) fmaxf(0.0f, g->s.clip_y);
+    *x1 = (int) fminf(g->sx, g->s.clip_x + g->s.clip_sx);
+    *y1 = (int) fminf(g->sy, g->s.clip_y + g->s.clip_sy);
+}
+
+
+/*
+    Accumulate the signed area of a line segment.
+    The segment must already be within `0 <= x <= width`.
+*/
+static void
+accumulate(Image *img, PgPt p0, PgPt p1)
+{
+    float   dir = 1.0f;
+    int     height = (int) img->_.sy;
+
+    if (p0.y == p1.y)
+        return;
+
+    if (p0.y > p1.y) {
+        PgPt tmp = p0;
+        p0 = p1;
+        p1 = tmp;
+        dir = -1.0f;
+    }
+
+    if (p1.y <= 0.0f || p0.y >= height)
+        return;
+
+    float   dxdy = (p1.x - p0.x) / (p1.y - p0.y);
+    float   x = p0.x;
+    int     ystart = (int) fmaxf(0.0f, floorf(p0.y));
+    int     yend = (int) fminf(height, ceilf(p1.y));
+
+    if (p0.y < 0.0f)
+        x -= p0.y * dxdy;
+
+    img->miny = ystart < img->miny? ystart: img->miny;
+    img->maxy = yend > img->maxy? yend: img->maxy;
+
+    for (int y = ystart; y < yend; y++) {
+        float   *row = img->acc + (size_t) y * img->stride;
+        float   dy = fminf(y + 1.0f, p1.y) - fmaxf((float) y, p0.y);
+        float   xnext = x + dxdy * dy;
+        float   d = dy * dir;
+        float   x0 = fminf(x, xnext);
+        float   x1 = fmaxf(x, xnext);
+        float   x0floor = floorf(x0);
+        int     x0i = (int) x0floor;
+        float   x1ceil = ceilf(x1);
+        int     x1i = (int) x1ceil;
+
+        if (x1i <= x0i + 1) {
+            // The segment stays in one pixel on this row.
+            float xmf = 0.5f * (x + xnext) - x0floor;
+            row[x0i] += d - d * xmf;
+            row[x0i + 1] += d * xmf;
+        }
+        else {
+            float s = 1.0f / (x1 - x0);
+            float x0f = x0 - x0floor;
+            float a0 = 0.5f * s * (1.0f - x0f) * (1.0f - x0f);
+            float x1f = x1 - x1ceil + 1.0f;
+            float am = 0.5f * s * x1f * x1f;
+
+            row[x0i] += d * a0;
+
+            if (x1i == x0i + 2)
+                row[x0i + 1] += d * (1.0f - a0 - am);
+            else {
+                float a1 = s * (1.5f - x0f);
+                row[x0i + 1] += d * (a1 - a0);
+                for (int xi = x0i + 2; xi < x1i - 1; xi++)
+                    row[xi] += d * s;
+                float a2 = a1 + (x1i - x0i - 3) * s;
+                row[x1i - 1] += d * (1.0f - a2 - am);
+            }
+
+            row[x1i] += d * am;
+        }
+
+        x = xnext;
+    }
+}
+
+
+/*
+    Add an edge, splitting it where it crosses either side of the canvas.
+    Parts outside are pinned to the side so that they still contribute
+    winding to the pixels inside.
+*/
+static void
+edge(Image *img, PgPt a, PgPt b)
+{
+    float   width = img->_.sx;
+    float   xs[2] = { 0.0f, width };
+    PgPt    pts[4] = { a };
+    unsigned n = 1;
+
+    if (a.x != b.x)
+        for (unsigned i = 0; i < 2; i++) {
+            float t = (xs[a.x < b.x? i: 1 - i] - a.x) / (b.x - a.x);
+            if (t > 0.0f && t < 1.0f)
+                pts[n++] = pgpt(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t);
+        }
+    pts[n++] = b;
+
+    for (unsigned i = 0; i < n; i++)
+        pts[i].x = fminf(fmaxf(pts[i].x, 0.0f), width);
+
+    for (unsigned i = 0; i + 1 < n; i++)
+        accumulate(img, pts[i], pts[i + 1]);
+}
+
+
+/*
+    Resolve accumulated coverage into the pixels using `paint`.
+    The accumulation buffer is cleared as it is read.
+*/
+static void
+composite(Pg *g, const PgPaint *paint, PgFillRule rule)
+{
+    Image       *img = IMAGE(g);
+    PgColor     ramp[RAMP_SIZE];
+    int         cx0, cy0, cx1, cy1;
+
+    clip_rect(g, &cx0, &cy0, &cx1, &cy1);
+    make_ramp(g, paint, ramp);
+
+    for (int y = img->miny; y < img->maxy; y++) {
+        float   *row = img->acc + (size_t) y * img->stride;
+        uint8_t *px = img->pixels + (size_t) y * (size_t) g->sx * 4;
+        bool    visible = y >= cy0 && y < cy1;
+        float   sum = 0.0f;
+
+        for (int x = 0; x < (int) img->stride; x++) {
+            sum += row[x];
+            row[x] = 0.0f;
+
+            if (!visible || x < cx0 || x >= cx1)
+                continue;
+
+            float coverage;
+            if (rule == PG_EVEN_ODD_RULE) {
+                float f = fmodf(fabsf(sum), 2.0f);
+                coverage = f > 1.0f? 2.0f - f: f;
+            }
+            else
+                coverage = fminf(fabsf(sum), 1.0f);
+
+            if (coverage > 1.0f / 512.0f)
+                blend(px + x * 4,
+                      paint_at(paint, ramp, x + 0.5f, y + 0.5f),
+                      coverage);
+        }
+    }
+
+    img->miny = (int) g->sy;
+    img->maxy = 0;
+}
+
+
+static void
+_commit(Pg *g)
+{
+    (void) g;
+}
+
+
+static void
+_clear(Pg *g)
+{
+    const PgPaint   *paint = g->s.clear;
+    PgColor         ramp[RAMP_SIZE];
+    int             x0, y0, x1, y1;
+
+    clip_rect(g, &x0, &y0, &x1, &y1);
+    make_ramp(g, paint, ramp);
+
+    for (int y = y0; y < y1; y++) {
+        uint8_t *px = IMAGE(g)->pixels + ((size_t) y * (size_t) g->sx + x0) * 4;
+
+        for (int x = x0; x < x1; x++, px += 4) {
+            PgColor c = paint_at(paint, ramp, x + 0.5f, y + 0.5f);
+
+            if (paint->nstops == 1) {
+                // A solid clear replaces what is there.
+                px[0] = (uint8_t) (c.u * 255.0f + 0.5f);
+                px[1] = (uint8_t) (c.v * 255.0f + 0.5f);
+                px[2] = (uint8_t) (c.w * 255.0f + 0.5f);
+                px[3] = (uint8_t) (c.a * 255.0f + 0.5f);
+            }
+            else
+                blend(px, c, 1.0f);
+        }
+    }
+}
+
+
+static inline bool
+invisible(const PgPaint *paint)
+{
+    return paint->nstops == 1 && paint->colors[0].a == 0.0f;
+}
+
+
+// Fill the path flattened into the scratch space.
+static void
+fill_flat(Pg *g, unsigned nsubs)
+{
+    const PgPt      *verts = IMAGE(g)->scratch.verts;
+    const unsigned  *subs = IMAGE(g)->scratch.subs;
+
+    // Every subpath is implicitly closed.
+    for (unsigned s = 0; s < nsubs; s++) {
+        unsigned    start = SUB(subs[s]);
+        unsigned    end = SUB(subs[s + 1]);
+
+        for (unsigned i = start; i < end; i++)
+            edge(IMAGE(g), verts[i], verts[i + 1 < end? i + 1: start]);
+    }
+
+    composite(g, g->s.fill, g->s.fill_rule);
+}
+
+
+// Stroke the path flattened into the scratch space.
+static void
+stroke_flat(Pg *g, unsigned nverts, unsigned nsubs)
+{
+    Scratch     *scratch = &IMAGE(g)->scratch;
+    PgPt        *tris;
+    unsigned    ntris;
+
+    tris = stroke_triangles(g, scratch, scratch->verts, nverts, scratch->subs, nsubs, &ntris);
+
+    /*
+        Triangles are all turned the same way so that overlaps at joins
+        add together and shared edges do not leave seams.
+    */
+    for (unsigned i = 0; i + 3 <= ntris; i += 3) {
+        PgPt a = tris[i];
+        PgPt b = tris[i + 1];
+        PgPt c = tris[i + 2];
+
+        if ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x) < 0.0f) {
+            PgPt tmp = b;
+            b = c;
+            c = tmp;
+        }
+
+        edge(IMAGE(g), a, b);
+        edge(IMAGE(g), b, c);
+        edge(IMAGE(g), c, a);
+    }
+
+    composite(g, g->s.stroke, PG_NONZERO_RULE);
+}
+
+
+static void
+_fill(Pg *g)
+{
+    unsigned    nverts;
+    unsigned    nsubs;
+
+    if (invisible(g->s.fill))
+        /* Skip everything if colour is transparent. */
+        return;
+
+    flatten(g, &IMAGE(g)->scratch, &nverts, &nsubs);
+    fill_flat(g, nsubs);
+}
+
+
+static void
+_stroke(Pg *g)
+{
+    unsigned    nverts;
+    unsigned    nsubs;
+
+    if (invisible(g->s.stroke))
+        return;
+
+    flatten(g, &IMAGE(g)->scratch, &nverts, &nsubs);
+    stroke_flat(g, nverts, nsubs);
+}
+
+
+// The path is flattened once for both.
+static void
+_fill_stroke(Pg *g)
+{
+    unsigned    nverts;
+    unsigned    nsubs;
+    bool        fill = !invisible(g->s.fill);
+    bool        stroke = !invisible(g->s.stroke);
+
+    if (!fill && !stroke)
+        return;
+
+    flatten(g, &IMAGE(g)->scratch, &nverts, &nsubs);
+
+    if (fill)
+        fill_flat(g, nsubs);
+    if (stroke)
+        stroke_flat(g, nverts, nsubs);
+}
+
+
+static PgPt
+_set_size(Pg *g, float width, float height)
+{
+    (void) width, (void) height;
+
+    /*
+        Images have a fixed size.
+     */
+    return pgpt(g->sx, g->sy);
+}
+
+
+static void
+_free(Pg *g)
+{
+    Image *img = IMAGE(g);
+
+    if (img->owned)
+        free(img->pixels);
+    free(img->acc);
+    free_scratch(&img->scratch);
+}
+
+
+Pg*
+pg_canvas_new_image(unsigned width, unsigned height, uint8_t *optional_pixels)
+{
+    if (!width || !height)
+        return 0;
+
+    unsigned    stride = width + 2;
+    uint8_t     *pixels = optional_pixels;
+    bool        owned = !optional_pixels;
+
+    if (owned)
+        pixels = calloc((size_t) width * height, 4);
+
+    return pgnew(Image,
+                 _pg_canvas_init(&methods, width, height),
+                 .pixels = pixels,
+                 .owned = owned,
+                 .acc = calloc((size_t) stride * height, sizeof(float)),
+                 .stride = stride,
+                 .miny = (int) height,
+                 .maxy = 0);
+}
+
+
+uint8_t*
+pg_canvas_get_image_pixels(Pg *g)
+{
+    if (!g || g->v != &methods)
+        return 0;
+
+    return IMAGE(g)->pixels;
+}
+
+
+static const PgCanvasFunc methods = {
+    _commit,
+    _clear,
+    _fill,
+    _stroke,
+    _fill_stroke,
+    _set_size,
+    _free,
+    0,
+    0,
+};
@@ -5,153 +5,586 @@
 #include <stdlib.h>
 #include <string.h>
 #include <GL/glew.h>
+#ifdef USE_EGL
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
+#endif
 #include <pg3/pg.h>
 #include <pg3/pg-internal-canvas.h>
+#include <pg3/pg-internal-font.h>
+#include <pg3/pg-internal-platform.h>
 #include "help.geometry.h"
+#include "help.flatten.h"
+#include "help.paint.h"
 
-#define BEZIER_LIMIT    10
-#define CLOSED          65536
-#define SUB(N)          ((N) & (CLOSED - 1))
 #define GL(G)           ((GL*) (G))
+#define LOOKAHEAD       256
+#define SWITCH_LOOKAHEAD 32
+#define RING_MIN        (64 * 1024)
+#define RING_PERIOD     256
+#define PAINT_VEC4S     3
+#define RAMP_SIZE       256
+#define RAMP_ROWS       64
+#define ATLAS_SIZE      1024
+#define GLYPH_MAX       128
+#define GLYPH_PAD       1
+#define SUBPIXELS       4
+#define MAX_QUADS       16
+
+/*
+    Drawing is deferred until the canvas is committed.
+    Each fill, stroke, and clear records a command and copies its vertices
+    into arrays shared by the whole frame. On commit, the vertices are
+    uploaded at once and the commands are drawn, with neighbouring
+    commands that use the same paint and scissor merged into one draw.
+*/
+
+typedef enum {
+    CMD_CLEAR,
+    CMD_FILL,
+    CMD_TRIANGLES,
+    CMD_GLYPHS,
+    CMD_RECTS,
+    CMD_INSTANCES,
+    CMD_LAYER,
+} CmdType;
+
+typedef struct {
+    CmdType     type;
+    PgPaint     paint;      // Copied because the caller may change theirs.
+    float       gamma;
+    PgFillRule  fill_rule;
+    GLint       scissor[4];
+    unsigned    first;      // First fan for fills of paths, first vertex
+                            // otherwise.
+                            // Glyph vertices and rectangles are counted
+                            // separately.
+    unsigned    count;      // Number of fans for fills, vertices otherwise.
+    unsigned    cover;      // First vertex of the cover quad for fills.
+    unsigned    curves;     // First textured vertex of curves for fills.
+    unsigned    ncurves;
+    unsigned    patches;    // First vertex of cubic control points for fills.
+    unsigned    npatches;
+    unsigned    instances;  // First instance for instanced fills.
+    unsigned    ninstances;
+    unsigned    fringe;     // First fringe vertex of antialiased fills.
+    unsigned    nfringe;
+    bool        stroke;     // Fill of the triangles of a stroke.
+    float       flatness;
+    GLuint      texture;    // Texture of a layer drawn.
+    float       opacity;
+    PgPt        min;
+    PgPt        max;
+} Cmd;
+
+typedef struct PathEntry PathEntry;
+struct PathEntry {
+    PathEntry   *chain;     // Next entry in the same bucket.
+    PathEntry   *newer;
+    PathEntry   *older;
+    uint32_t    hash;
+    float       linear[4];
+    float       flatness;
+    PgPt        origin;     // Translation the vertices were flattened with.
+    size_t      size;
+    PgPart      *parts;
+    unsigned    nparts;
+    PgPt        *verts;
+    unsigned    nverts;
+    unsigned    *subs;
+    unsigned    nsubs;
+};
+
+/*
+    A flattened path in the scratch space or the cache.
+    Curves left to the GPU are either triples of control points of
+    implicit quadratics, or cubic patches of four control points.
+*/
+typedef struct {
+    const PgPt      *verts;
+    unsigned        nverts;
+    const unsigned  *subs;
+    unsigned        nsubs;
+    PgPt            offset; // Translation to add to the vertices.
+    const PgPt      *curves;
+    unsigned        ncurves;
+    bool            patches;
+    bool            convex; // One convex subpath.
+} Flat;
 
 typedef struct {
+    unsigned    font;       // Serial number of the font.
+    unsigned    glyph;
+    PgPt        scale;      // Font scale times the scale of the CTM.
+    unsigned    subpixel;   // Horizontal offset in steps of 1 / SUBPIXELS.
+} GlyphKey;
+
+typedef struct {
+    GlyphKey    key;
+    unsigned    gen;        // Generation of the shelf. Zero if unused.
+    unsigned    shelf;
+    int         u, v;       // Position in the atlas.
+    int         left, top;  // Position relative to the pen.
+    int         sx, sy;     // Zero for blank glyphs.
+} Glyph;
+
+typedef struct {
+    int         y;
+    int         height;
+    int         x;          // Start of the free space.
+    unsigned    used;       // Flush on which it was last drawn from.
+    unsigned    gen;        // Changed whenever it is emptied.
+} Shelf;
+
+// Gradient whose colours are in a row of the ramp texture.
+typedef struct {
+    uint32_t        hash;
+    unsigned        used;   // When last drawn. Zero if unused.
+    PgColorSpace    cspace;
+    unsigned        nstops;
+    float           stops[8];
+    PgColor         colors[8];
+    float           gamma;
+} Ramp;
+
+// Variants of the main program, by paint.
+typedef enum {
+    VARIANT_SOLID,
+    VARIANT_LINEAR,
+    NVARIANTS,
+} Variant;
+
+typedef struct {
+    GLuint      prog, fsh;
+    GLint       ctmloc, paintloc;
+    GLfloat     bound[PAINT_VEC4S * 4];
+    bool        isbound;
+} Program;
+
+/*
+    Pixels read into a pixel buffer, to be given to the callback once the
+    GL has written them.
+*/
+typedef struct {
+    GLuint      pbo;
+    GLsync      fence;      // Zero without sync objects.
+    unsigned    commit;     // Commit the read was made before.
+    unsigned    width, height;
+    PgPixelsCallback *callback;
+    void        *data;
+} Readback;
+
+typedef struct GL GL;
+struct GL {
     Pg          _;
-    GLuint      prog, vsh, fsh;
-    GLint       posloc, ctmloc;
-} GL;
+    GL          *parent;    // Canvas the programs are shared with if this
+                            // is a layer.
+    GLuint      fbo;        // Zero unless this is a layer or offscreen.
+    GLuint      texture;    // Colour of a layer.
+    GLuint      color;      // Colour of an offscreen canvas.
+    GLuint      stencil;
+    bool        egl;        // Uses the offscreen EGL context.
+    bool        pending;    // Drawn by the parent, which has not flushed
+    unsigned    drawnepoch; // since the parent's epoch when it was drawn.
+    GLuint      vsh;
+    Program     progs[NVARIANTS];
+    Variant     variant;    // Program in use.
+    GLuint      curveprog, curvefsh;
+    GLint       curvectmloc;
+    GLuint      patchprog, patchvsh, patchgsh, patchfsh;
+    GLint       patchctmloc, patchsizeloc, patchtolloc;
+    GLuint      layerprog, layerfsh;
+    GLint       layerctmloc, opacityloc;
+    GLint       posloc, uvloc;
+    GLint       rectloc, radiusloc;
+    GLint       xformxloc, xformyloc, colorloc;
+
+    Cmd         *cmds;
+    unsigned    ncmds, maxcmds;
+    PgPt        *verts;
+    unsigned    nverts, maxverts;
+    PgPt        *covers;
+    unsigned    ncovers, maxcovers;
+    GLint       *fanfirst;  // First vertex and count of each fan kept
+    GLsizei     *fancount;  // apart to be passed to glMultiDrawArrays().
+    unsigned    nfans, maxfans;
+    GLfloat     *quads;     // Position and texture coordinate per vertex
+                            // for glyphs and implicit curves.
+    unsigned    nquads, maxquads;
+    GLfloat     *rects;     // Bounds and corner radii of each rectangle.
+    unsigned    nrects, maxrects;
+    GLfloat     *instances; // Transform and colour of each instance.
+    unsigned    ninstances, maxinstances;
+    GLfloat     *fringes;   // Position and ends of the edge per vertex.
+    unsigned    nfringes, maxfringes;
+    PgPt        *moved;     // Copy of a flattened path being moved.
+    unsigned    maxmoved;
+    Scratch     scratch;
+
+    bool        *done;
+    unsigned    maxdone;
+    unsigned    group[2 * (LOOKAHEAD + 1)];
+    unsigned    first[LOOKAHEAD + 1];
+    unsigned    count[LOOKAHEAD + 1];
+
+    GLuint      ring;
+    size_t      ringsize;
+    size_t      ringhead;
+    size_t      ringpeak;
+    unsigned    ringflushes;
+    bool        mappable;
+    GLintptr    vertoffset, quadoffset, rectoffset, instanceoffset, fringeoffset;
+    GLuint      corners;    // Unit square that rectangles are drawn from.
+                            // Zero without instanced arrays.
+
+    GLuint      ramps;      // Texture of gradients. Zero until needed.
+    Ramp        rampcache[RAMP_ROWS];
+    unsigned    rampuses;
+
+    GLuint      atlas;
+    int         atlassize;  // Zero if glyphs are not cached.
+    Pg          *raster;
+    Shelf       *shelves;
+    unsigned    nshelves, maxshelves;
+    Glyph       *glyphs;    // Hash table.
+    unsigned    nglyphs, maxglyphs;
+    unsigned    gen;
+    unsigned    epoch;      // Number of flushes.
+
+    PathEntry   **paths;    // Hash table.
+    unsigned    npaths, maxpaths;
+    PathEntry   *newest, *oldest;
+    size_t      pathsize, pathcap;
+    unsigned    pathhits, pathmisses;
+
+    bool        implicit;   // Fill curves implicitly.
+    bool        analytic;   // Antialias with fringes.
+
+    GLint       redraw[4];  // Scissor that all commands are limited to
+    bool        limited;    // until the next commit.
+    PgPt        drawnmin, drawnmax;     // Bounds of commands flushed since
+                                        // the last commit.
+    PgPt        damagemin, damagemax;   // Bounds flushed by the last commit.
+
+    Readback    *reads;     // Queue of reads not yet delivered.
+    unsigned    nreads, maxreads;
+    GLuint      *spares;    // Pixel buffers of reads delivered.
+    unsigned    nspares, maxspares;
+    uint8_t     *readrows;  // Rows of a read being turned over.
+    unsigned    maxreadrows;
+    bool        fences;     // Sync objects tell when reads are done.
+    unsigned    commits;
+};
 
 static const PgCanvasFunc methods;
 
+/*
+    Rectangles are drawn as instances of a unit square stretched over
+    their bounds and a pixel beyond, with `radius` negative otherwise.
+    Instances of other shapes are moved by `xform_x` and `xform_y` and
+    drawn in `color`, which is negative otherwise.
+    Fringes of edges carry the ends of the edge in `rect` instead, with
+    `radius` below -1.
+*/
 static const char *VERTEX_SHADER[] = {
     "#version 110",
     "uniform mat3 ctm;",
     "attribute vec2 pos;",
+    "attribute vec2 uv;",
+    "attribute vec4 rect;",
+    "attribute vec2 radius;",
+    "attribute vec3 xform_x;",
+    "attribute vec3 xform_y;",
+    "attribute vec4 color;",
+    "varying vec2 texcoord;",
+    "varying vec2 device;",
+    "varying vec4 box;",
+    "varying vec2 corner;",
+    "varying vec4 tint;",
     "void main() {",
-    "   vec3 p = ctm * vec3(pos, 1.0);",
+    "   vec2 at = radius.x < 0.0? pos: mix(rect.xy - 1.0, rect.zw + 1.0, pos);",
+    "   at = vec2(dot(xform_x, vec3(at, 1.0)), dot(xform_y, vec3(at, 1.0)));",
+    "   vec3 p = ctm * vec3(at, 1.0);",
     "   gl_Position = vec4(p.x, p.y, 0.0, 1.0);",
+    "   texcoord = uv;",
+    "   device = at;",
+    "   box = rect;",
+    "   corner = radius;",
+    "   tint = color;",
     "}",
     0
 };
 
 static const char *FRAGMENT_SHADER[] = {
     "#version 110",
-    "uniform int     cspace;",
-    "uniform int     type;",
-    "uniform vec2    a;",
-    "uniform vec2    b;",
-    "uniform float   ra;",
-    "uniform float   rb;",
-    "uniform float   stops[8];",
-    "uniform vec4    colors[8];",
-    "uniform int     nstops;",
-    "uniform float   igamma;",
+    "uniform vec4    paint[3];",
+    "uniform sampler2D atlas;",
+    "uniform sampler2D ramps;",
+    "varying vec2    texcoord;",
+    "varying vec2    device;",
+    "varying vec4    box;",
+    "varying vec2    corner;",
+    "varying vec4    tint;",
     "",
-    "vec4 lchab_to_lab(vec4 lch) {",
-    "    float l = lch.x;",
-    "    float c = lch.y;",
-    "    float h = lch.z * 2.0 * 3.14159;",
-    "    return vec4(l, c * cos(h), c * sin(h), lch.w);",
+    "// Coverage of a pixel by a rectangle, found from its distance to the edge.",
+    "// Rounded corners are quadratic curves, which measured inwards from the",
+    "// corner in units of the radius are the parabola (a - b)^2 - 2(a + b) + 1 = 0.",
+    "float rect_coverage() {",
+    "    vec2 extent = 0.5 * (box.zw - box.xy);",
+    "    vec2 q = abs(device - 0.5 * (box.xy + box.zw)) - extent + corner;",
+    "    float d;",
+    "    if (q.x > 0.0 && q.y > 0.0 && corner.x > 0.0) {",
+    "        vec2 ab = 1.0 - q / corner;",
+    "        float e = ab.x - ab.y;",
+    "        float f = e * e - 2.0 * (ab.x + ab.y) + 1.0;",
+    "        d = f / length(vec2(2.0 * e - 2.0, -2.0 * e - 2.0) / corner);",
+    "    }",
+    "    else",
+    "        d = max(q.x - corner.x, q.y - corner.y);",
+    "    return clamp(0.5 - d, 0.0, 1.0);",
+    "}",
+    "",
+    "// Coverage of a pixel outside a shape, found from its distance to an edge.",
+    "float edge_coverage() {",
+    "    vec2 ab = box.zw - box.xy;",
+    "    vec2 ap = device - box.xy;",
+    "    float t = clamp(dot(ap, ab) / dot(ab, ab), 0.0, 1.0);",
+    "    return 0.5 - length(ap - t * ab);",
     "}",
-    "vec4 lab_to_xyz(vec4 lab) {",
-    "    float l = lab.x;",
-    "    float y = (l + 16.0) / 116.0;",
-    "    float x = y + lab.y / 500.0;",
-    "    float z = y - lab.z / 200.0;",
-    "    x = x > 24.0 / 116.0? x*x*x: (x - 16.0/116.0) * 108.0/841.0;",
-    "    y = y > 24.0 / 116.0? y*y*y: (y - 16.0/116.0) * 108.0/841.0;",
-    "    z = z > 24.0 / 116.0? z*z*z: (z - 16.0/116.0) * 108.0/841.0;",
-    "    return vec4(x * 950.4, y * 1000.0, z * 1088.8, lab.w);",
+    "",
+    "void main() {",
+    "    if (tint.a >= 0.0) // Colour of an instance, already converted.",
+    "        gl_FragColor = tint;",
+    "    else {",
+    "#if defined(SOLID) // Already converted.",
+    "        gl_FragColor = paint[2];",
+    "#else",
+    "        vec2 dv = paint[1].zw - paint[1].xy;",
+    "        vec2 dp = vec2(gl_FragCoord) - paint[1].xy;",
+    "        float t = dot(dv, dp) / dot(dv, dv);",
+    "        // Sample between the centres of the first and last texels.",
+    "        t = clamp(t, 0.0, 1.0) * paint[0].z + paint[0].w;",
+    "        gl_FragColor = texture2D(ramps, vec2(t, paint[0].y));",
+    "#endif",
+    "    }",
+    "    if (texcoord.x >= 0.0) // Glyph coverage.",
+    "        gl_FragColor.a *= texture2D(atlas, texcoord).a;",
+    "    if (corner.x >= 0.0)",
+    "        gl_FragColor.a *= rect_coverage();",
+    "    else if (corner.x < -1.5) {",
+    "        // Leave the stencil unmarked for another edge to cover.",
+    "        float c = edge_coverage();",
+    "        if (c <= 0.0)",
+    "            discard;",
+    "        gl_FragColor.a *= c;",
+    "    }",
     "}",
-    "vec4 xyz_to_rgb(vec4 xyz) {",
-    "    const mat3 m = mat3( 3.2404542, -0.9692660, 0.0556434,",
-    "                        -1.5371385, 1.8760108, -0.2040259,",
-    "                        -0.4985314, 0.0415560,  1.0572252);",
-    "    return clamp(vec4(m * vec3(xyz), xyz.w), 0.0, 1.0);",
+    0
+};
+
+// Draw a layer, whose colours are already multiplied by alpha.
+static const char *LAYER_SHADER[] = {
+    "#version 110",
+    "uniform sampler2D layer;",
+    "uniform float   opacity;",
+    "varying vec2    texcoord;",
+    "void main() {",
+    "    gl_FragColor = texture2D(layer, texcoord) * opacity;",
     "}",
-    "vec4 gamma(vec4 rgb) {",
-    "    float r = rgb.x;",
-    "    float g = rgb.y;",
-    "    float b = rgb.z;",
-    "    return vec4(r < 0.0031308? 12.92 * r: 1.055 * pow(r, igamma) - 0.055,",
-    "                g < 0.0031308? 12.92 * g: 1.055 * pow(g, igamma) - 0.055,",
-    "                b < 0.0031308? 12.92 * b: 1.055 * pow(b, igamma) - 0.055,",
-    "                rgb.w);",
+    0
+};
+
+/*
+    Keep the part of a curve's triangle between the curve and its chord.
+    The triangle is drawn in coordinates where the curve is u^2 = v
+    (Loop and Blinn).
+*/
+static const char *CURVE_SHADER[] = {
+    "#version 110",
+    "varying vec2    texcoord;",
+    "void main() {",
+    "    if (texcoord.x * texcoord.x > texcoord.y)",
+    "        discard;",
+    "    gl_FragColor = vec4(0.0);",
     "}",
-    "vec4 convert(vec4 color) {",
-    "    return  cspace == 0? gamma(color):",
-    "            cspace == 1? gamma(xyz_to_rgb(lab_to_xyz(lchab_to_lab(color)))):",
-    "            cspace == 2? gamma(xyz_to_rgb(lab_to_xyz(color))):",
-    "            cspace == 3? gamma(xyz_to_rgb(color)):",
-    "            gamma(color);",
+    0
+};
+
+static const char *PATCH_VERTEX_SHADER[] = {
+    "#version 150",
+    "uniform mat3 ctm;",
+    "in vec2 pos;",
+    "void main() {",
+    "   vec3 p = ctm * vec3(pos, 1.0);",
+    "   gl_Position = vec4(p.x, p.y, 0.0, 1.0);",
     "}",
-    "vec4 stopcolor(float t) {",
-    "    int i;",
-    "    for (i = 0; i < nstops && t > stops[i]; i++) {}",
-    "    vec4 color =   i == 0? colors[0]:",
-    "                    i == nstops? colors[nstops - 1]:",
-    "    mix(colors[i - 1],",
-    "        colors[i],",
-    "        (t - stops[i - 1]) / (stops[i] - stops[i - 1]));",
-    "    return convert(color);",
+    0
+};
+
+/*
+    Fan a cubic from its start into triangles.
+    The number of segments is from Wang's formula in pixels.
+*/
+static const char *PATCH_GEOMETRY_SHADER[] = {
+    "#version 150",
+    "layout(lines_adjacency) in;",
+    "layout(triangle_strip, max_vertices = 192) out;",
+    "uniform vec2    size;       // Pixels per unit of clip space.",
+    "uniform float   tolerance;",
+    "vec4 at(float t) {",
+    "    float s = 1.0 - t;",
+    "    return  s * s * s * gl_in[0].gl_Position +",
+    "            3.0 * s * s * t * gl_in[1].gl_Position +",
+    "            3.0 * s * t * t * gl_in[2].gl_Position +",
+    "            t * t * t * gl_in[3].gl_Position;",
     "}",
     "void main() {",
-    "    if (nstops == 1)",
-    "        gl_FragColor = convert(colors[0]);",
-    "    else if (type == 2) // Radial gradient.",
-    "        gl_FragColor = stopcolor(length(vec2(gl_FragCoord) - a) / (rb - ra));",
-    "    else { // Linear gradient.",
-    "        vec2 dv = b - a;",
-    "        vec2 dp = vec2(gl_FragCoord) - a;",
-    "        float t = dot(dv, dp) / dot(dv, dv);",
-    "        gl_FragColor = stopcolor(t);",
+    "    vec2 d1 = gl_in[0].gl_Position.xy - 2.0 * gl_in[1].gl_Position.xy + gl_in[2].gl_Position.xy;",
+    "    vec2 d2 = gl_in[1].gl_Position.xy - 2.0 * gl_in[2].gl_Position.xy + gl_in[3].gl_Position.xy;",
+    "    float m = max(length(d1 * size), length(d2 * size));",
+    "    int n = int(clamp(ceil(sqrt(0.75 * m / tolerance)), 1.0, 64.0));",
+    "    vec4 prev = at(1.0 / float(n));",
+    "    for (int i = 2; i <= n; i++) {",
+    "        vec4 next = i == n? gl_in[3].gl_Position: at(float(i) / float(n));",
+    "        gl_Position = gl_in[0].gl_Position;",
+    "        EmitVertex();",
+    "        gl_Position = prev;",
+    "        EmitVertex();",
+    "        gl_Position = next;",
+    "        EmitVertex();",
+    "        EndPrimitive();",
+    "        prev = next;",
     "    }",
     "}",
     0
 };
 
-static inline PgPt
-perp(PgPt p)
-{
-    return pgpt(-p.y, p.x);
-}
+static const char *PATCH_FRAGMENT_SHADER[] = {
+    "#version 150",
+    "out vec4 color;",
+    "void main() {",
+    "    color = vec4(0.0);",
+    "}",
+    0
+};
 
-static inline PgPt
-normalize(PgPt p)
+/*
+    Reserve `size` bytes in the streaming vertex buffer and return the
+    offset. The buffer is written front to back across draws and frames.
+    When it runs out, its storage is orphaned so that the driver can hand
+    back fresh memory without waiting for earlier draws to finish.
+    It grows to fit the largest upload and shrinks again if that much
+    has not been needed for a while.
+*/
+static GLintptr
+ring_alloc(GL *gl, size_t size)
 {
-    float invmag = 1.0f / sqrtf(p.x * p.x + p.y * p.y);
-    return pgpt(p.x * invmag, p.y * invmag);
+    size_t  want = gl->ringsize? gl->ringsize: RING_MIN;
+
+    gl->ringpeak = size > gl->ringpeak? size: gl->ringpeak;
+
+    if (++gl->ringflushes == RING_PERIOD) {
+        while (want > RING_MIN && want >= 16 * gl->ringpeak)
+            want /= 2;
+        gl->ringflushes = 0;
+        gl->ringpeak = size;
+    }
+
+    while (want < 4 * size)
+        want *= 2;
+
+    glBindBuffer(GL_ARRAY_BUFFER, gl->ring);
+
+    if (want != gl->ringsize || gl->ringhead + size > gl->ringsize) {
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) want, 0, GL_STREAM_DRAW);
+        gl->ringsize = want;
+        gl->ringhead = 0;
+    }
+
+    GLintptr offset = (GLintptr) gl->ringhead;
+    gl->ringhead += (size + 15) & ~(size_t) 15;
+    return offset;
 }
 
-static inline float
-dot(PgPt a, PgPt b)
+
+/*
+    Copy the frame's vertices into the streaming buffer.
+    The range is written through a mapping where the GL supports it so
+    that nothing waits on draws still reading other parts of the buffer.
+*/
+static void
+upload(GL *gl)
 {
-    return a.x * b.x + a.y * b.y;
-}
+    size_t      vsize = gl->nverts * sizeof *gl->verts;
+    size_t      csize = gl->ncovers * sizeof *gl->covers;
+    size_t      qsize = gl->nquads * 4 * sizeof *gl->quads;
+    size_t      rsize = gl->nrects * 6 * sizeof *gl->rects;
+    size_t      isize = gl->ninstances * 10 * sizeof *gl->instances;
+    size_t      fsize = gl->nfringes * 6 * sizeof *gl->fringes;
+    GLintptr    offset = ring_alloc(gl, vsize + csize + qsize + rsize + isize + fsize);
+    uint8_t     *dst = 0;
+
+    if (gl->mappable)
+        dst = glMapBufferRange(GL_ARRAY_BUFFER,
+                               offset,
+                               (GLsizeiptr) (vsize + csize + qsize + rsize + isize + fsize),
+                               GL_MAP_WRITE_BIT |
+                               GL_MAP_INVALIDATE_RANGE_BIT |
+                               GL_MAP_UNSYNCHRONIZED_BIT);
+
+    if (dst) {
+        memcpy(dst, gl->verts, vsize);
+        memcpy(dst + vsize, gl->covers, csize);
+        memcpy(dst + vsize + csize, gl->quads, qsize);
+        memcpy(dst + vsize + csize + qsize, gl->rects, rsize);
+        memcpy(dst + vsize + csize + qsize + rsize, gl->instances, isize);
+        memcpy(dst + vsize + csize + qsize + rsize + isize, gl->fringes, fsize);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    else {
+        glBufferSubData(GL_ARRAY_BUFFER, offset, (GLsizeiptr) vsize, gl->verts);
+        glBufferSubData(GL_ARRAY_BUFFER, offset + (GLintptr) vsize, (GLsizeiptr) csize, gl->covers);
+        glBufferSubData(GL_ARRAY_BUFFER, offset + (GLintptr) (vsize + csize), (GLsizeiptr) qsize, gl->quads);
+        glBufferSubData(GL_ARRAY_BUFFER, offset + (GLintptr) (vsize + csize + qsize), (GLsizeiptr) rsize, gl->rects);
+        glBufferSubData(GL_ARRAY_BUFFER, offset + (GLintptr) (vsize + csize + qsize + rsize), (GLsizeiptr) isize, gl->instances);
+        glBufferSubData(GL_ARRAY_BUFFER, offset + (GLintptr) (vsize + csize + qsize + rsize + isize), (GLsizeiptr) fsize, gl->fringes);
+    }
 
+    gl->vertoffset = offset;
+    gl->quadoffset = offset + (GLintptr) (vsize + csize);
+    gl->rectoffset = offset + (GLintptr) (vsize + csize + qsize);
+    gl->instanceoffset = offset + (GLintptr) (vsize + csize + qsize + rsize);
+    gl->fringeoffset = offset + (GLintptr) (vsize + csize + qsize + rsize + isize);
+}
 
 
-static GLuint
-make_buffer(GLenum target, const void *data, size_t size)
+static uint32_t
+hash_bytes(uint32_t h, const void *data, size_t size)
 {
-    GLuint buf;
-    glGenBuffers(1, &buf);
-    glBindBuffer(target, buf);
-    glBufferData(target, (GLsizei) size, data, GL_STREAM_DRAW);
-    return buf;
+    const uint8_t *p = data;
+
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
 }
 
 
+// The definition, if there is one, goes after the first line (#version).
 static GLuint
-make_shader(GLenum type, const GLchar **srcarray)
+make_shader(GLenum type, const char *define, const GLchar **srcarray)
 {
     char    *src = 0;
     GLsizei size = 0;
     for (unsigned i = 0; srcarray[i]; i++) {
-        size_t s = strlen(srcarray[i]);
-        src = realloc(src, (size_t) size + 1 + s + 1);
-        memcpy(src + size, srcarray[i], s);
-        size += s + 1;
-        src[size - 1] = '\n';
+        const char *lines[] = { srcarray[i], i == 0? define: 0 };
+
+        for (unsigned j = 0; j < 2 && lines[j]; j++) {
+            size_t s = strlen(lines[j]);
+            src = realloc(src, (size_t) size + 1 + s + 1);
+            memcpy(src + size, lines[j], s);
+            size += s + 1;
+            src[size - 1] = '\n';
+        }
     }
     src[size] = 0;
 
@@ -174,13 +607,27 @@ make_shader(GLenum type, const GLchar **srcarray)
 }
 
 
+// The geometry shader is optional.
 static GLuint
-make_program(GLuint vshader, GLuint fshader)
+make_program(GLuint vshader, GLuint gshader, GLuint fshader)
 {
     GLint   ok;
     GLuint  program = glCreateProgram();
     glAttachShader(program, vshader);
+    if (gshader)
+        glAttachShader(program, gshader);
     glAttachShader(program, fshader);
+
+    // Programs share the same vertex arrays.
+    glBindAttribLocation(program, 0, "pos");
+    glBindAttribLocation(program, 1, "uv");
+    glBindAttribLocation(program, 2, "rect");
+    glBindAttribLocation(program, 3, "radius");
+    glBindAttribLocation(program, 4, "xform_x");
+    glBindAttribLocation(program, 5, "xform_y");
+    glBindAttribLocation(program, 6, "color");
+    if (GLEW_ARB_get_program_binary)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(program);
     glGetProgramiv(program, GL_LINK_STATUS, &ok);
     if (!ok) {
@@ -194,491 +641,2919 @@ make_program(GLuint vshader, GLuint fshader)
 }
 
 
-static void
-set_coords(Pg *g)
+/*
+    Identify the driver that program binaries are saved by.
+    Zero means binaries cannot be saved.
+*/
+static uint32_t
+driver_hash(void)
 {
-    GL *gl = GL(g);
-
-    glUseProgram(gl->prog);
+    GLint   nformats = 0;
+
+    if (GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nformats);
+    if (!nformats)
+        return 0;
+
+    const GLubyte   *strings[] = {
+        glGetString(GL_VENDOR),
+        glGetString(GL_RENDERER),
+        glGetString(GL_VERSION),
+    };
+    uint32_t        h = 2166136261u;
+
+    for (unsigned i = 0; i < 3; i++) {
+        if (!strings[i])
+            return 0;
+        h = hash_bytes(h, strings[i], strlen((const char*) strings[i]) + 1);
+    }
+    return h? h: 1;
+}
 
-    glEnable(GL_SCISSOR_TEST);
-    glScissor((GLint) g->s.clip_x,
-              (GLint) (g->sy - g->s.clip_y - g->s.clip_sy),
-              (GLsizei) g->s.clip_sx,
-              (GLsizei) g->s.clip_sy);
 
-    float ctm[] = { 2.0f / g->sx, 0.0f, 0.0f,
-                    0.0f, -2.0f / g->sy, 0.0f,
-                    -1.0f, 1.0f, 0.0f };
-    glUniformMatrix3fv(gl->ctmloc, 1, false, ctm);
-    glUniform1f(glGetUniformLocation(gl->prog, "igamma"), 1.0f / g->s.gamma);
+static uint32_t
+hash_source(uint32_t h, const GLchar **srcarray)
+{
+    for (unsigned i = 0; srcarray && srcarray[i]; i++)
+        h = hash_bytes(h, srcarray[i], strlen(srcarray[i]));
+    return hash_bytes(h, "", 1);
 }
 
 
-static void
-set_paint(Pg *g, const PgPaint *paint)
+// Cached binaries start with this header.
+typedef struct {
+    char        magic[4];
+    GLenum      format;
+} BinaryHeader;
+
+
+static GLuint
+load_binary(const char *path)
 {
-    GL      *gl = GL(g);
-    GLuint  prog = gl->prog;
+    size_t  size;
+    uint8_t *data = _pg_file_map(path, &size);
+    GLuint  program = 0;
+
+    if (!data)
+        return 0;
 
-    glUniform1i(glGetUniformLocation(prog, "nstops"), paint->nstops);
+    BinaryHeader    header;
 
-    for (unsigned i = 0; i < paint->nstops; i++) {
-        char tmp[16];
-        snprintf(tmp, sizeof tmp, "colors[%d]", i);
-        glUniform4f(glGetUniformLocation(prog, tmp),
-            paint->colors[i].u,
-            paint->colors[i].v,
-            paint->colors[i].w,
-            paint->colors[i].a);
+    if (size > sizeof header) {
+        memcpy(&header, data, sizeof header);
 
-        snprintf(tmp, sizeof tmp, "stops[%d]", i);
-        glUniform1f(glGetUniformLocation(prog, tmp), paint->stops[i]);
+        if (!memcmp(header.magic, "pg3p", 4)) {
+            GLint   ok;
+
+            program = glCreateProgram();
+            glProgramBinary(program, header.format,
+                            data + sizeof header,
+                            (GLsizei) (size - sizeof header));
+            glGetProgramiv(program, GL_LINK_STATUS, &ok);
+            if (!ok) {
+                glDeleteProgram(program);
+                program = 0;
+            }
+        }
     }
 
-    float h = g->sy;
-    glUniform1i(glGetUniformLocation(prog, "type"), paint->type);
-    glUniform1i(glGetUniformLocation(prog, "cspace"), paint->cspace);
-    glUniform2f(glGetUniformLocation(prog, "a"), paint->a.x, h - paint->a.y);
-    glUniform2f(glGetUniformLocation(prog, "b"), paint->b.x, h - paint->b.y);
-    glUniform1f(glGetUniformLocation(prog, "ra"), paint->ra);
-    glUniform1f(glGetUniformLocation(prog, "rb"), paint->rb);
+    _pg_file_unmap(data, size);
+    return program;
 }
 
 
 static void
-_free(Pg *g)
+save_binary(const char *path, GLuint program)
 {
-    GL *gl = GL(g);
-    glDeleteShader(gl->vsh);
-    glDeleteShader(gl->fsh);
-    glDeleteProgram(gl->prog);
+    GLint   size = 0;
+
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0)
+        return;
+
+    BinaryHeader    header = { "pg3p", 0 };
+    uint8_t         *data = malloc(sizeof header + (size_t) size);
+
+    glGetProgramBinary(program, size, &size, &header.format, data + sizeof header);
+    memcpy(data, &header, sizeof header);
+    if (size > 0)
+        _pg_file_save(path, data, sizeof header + (size_t) size);
+    free(data);
 }
 
 
-static void
-_commit(Pg *g)
+/*
+    Build a program from vertex, optional geometry, and fragment shader
+    sources, with `define` added to the fragment shader.
+    Shaders are compiled into `*vsh`, `*gsh`, and `*fsh` unless they
+    already have been, so that programs can share them.
+
+    If the driver can save program binaries, the linked program is saved
+    in the user's cache, named by the driver and the sources, so later runs
+    skip compiling. A binary the driver rejects, as it may after it is
+    updated, is built again from source and replaced.
+*/
+static GLuint
+build_program(uint32_t driver,
+              GLuint *vsh, const GLchar **vsrc,
+              GLuint *gsh, const GLchar **gsrc,
+              GLuint *fsh, const GLchar **fsrc,
+              const char *define)
 {
-    (void) g;
-    glFlush();
+    char    *path = 0;
+    GLuint  program = 0;
+
+    if (driver) {
+        uint32_t    h = hash_source(2166136261u, vsrc);
+        char        name[32];
+
+        h = hash_source(h, gsrc);
+        h = hash_source(h, fsrc);
+        h = hash_bytes(h, define? define: "", define? strlen(define): 0);
+        snprintf(name, sizeof name, "gl-%08x-%08x", driver, h);
+        path = _pg_cache_path(name);
+        program = load_binary(path);
+    }
+
+    if (!program) {
+        if (!*vsh)
+            *vsh = make_shader(GL_VERTEX_SHADER, 0, vsrc);
+        if (gsrc && !*gsh)
+            *gsh = make_shader(GL_GEOMETRY_SHADER, 0, gsrc);
+        if (!*fsh)
+            *fsh = make_shader(GL_FRAGMENT_SHADER, define, fsrc);
+        program = make_program(*vsh, gsrc? *gsh: 0, *fsh);
+        if (path)
+            save_binary(path, program);
+    }
+
+    free(path);
+    return program;
 }
 
 
-static void
-_clear(Pg *g)
+// Build the main program for the paint chosen by `define`.
+static Program
+make_variant(uint32_t driver, GLuint *vsh, const char *define)
 {
-    const PgPaint *paint = g->s.clear;
-
-    if (paint->nstops == 1) {
-        set_coords(g);
+    GLuint  fsh = 0;
+    GLuint  prog = build_program(driver, vsh, VERTEX_SHADER, 0, 0,
+                                 &fsh, FRAGMENT_SHADER, define);
+
+    // Texture units are fixed.
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "atlas"), 0);
+    glUniform1i(glGetUniformLocation(prog, "ramps"), 1);
+
+    return (Program) {
+        .prog = prog,
+        .fsh = fsh,
+        .ctmloc = glGetUniformLocation(prog, "ctm"),
+        .paintloc = glGetUniformLocation(prog, "paint"),
+    };
+}
 
-        PgColor c = pg_color_to_rgb(paint->cspace,
-                                            paint->colors[0],
-                                            g->s.gamma);
-        glClearColor(c.u, c.v, c.w, c.a);
-        glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-    }
 
-    else {
-        GL      *gl = GL(g);
+static bool
+same_paint(const PgPaint *a, const PgPaint *b)
+{
+    if (a->type != b->type ||
+        a->cspace != b->cspace ||
+        a->nstops != b->nstops ||
+        a->a.x != b->a.x || a->a.y != b->a.y ||
+        a->b.x != b->b.x || a->b.y != b->b.y ||
+        a->ra != b->ra || a->rb != b->rb)
+        return false;
+
+    for (unsigned i = 0; i < a->nstops; i++)
+        if (a->stops[i] != b->stops[i] ||
+            memcmp(&a->colors[i], &b->colors[i], sizeof a->colors[i]))
+            return false;
+
+    return true;
+}
 
-        set_coords(g);
-        set_paint(g, paint);
 
-        GLfloat verts[] = { 0.0f, 0.0f,
-                            g->sx, 0.0f,
-                            0.0f, g->sy,
-                            g->sx, g->sy };
+// Commands can share draw calls if they draw the same way.
+static bool
+same_state(const Cmd *a, const Cmd *b)
+{
+    return  a->type == b->type &&
+            a->gamma == b->gamma &&
+            (a->type != CMD_FILL || (a->fill_rule == b->fill_rule &&
+                                     a->flatness == b->flatness &&
+                                     a->stroke == b->stroke)) &&
+            !memcmp(a->scissor, b->scissor, sizeof a->scissor) &&
+            same_paint(&a->paint, &b->paint);
+}
 
-        GLuint quads = make_buffer(GL_ARRAY_BUFFER, verts, 8 * sizeof *verts);
-        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0, 0);
-        glEnableVertexAttribArray(gl->posloc);
 
-        glDisable(GL_STENCIL_TEST);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+static inline bool
+overlaps(const Cmd *a, const Cmd *b)
+{
+    return  a->min.x <= b->max.x && b->min.x <= a->max.x &&
+            a->min.y <= b->max.y && b->min.y <= a->max.y;
+}
 
-        glDisableVertexAttribArray(gl->posloc);
-        glDeleteBuffers(1, &quads);
 
-        glClear(GL_STENCIL_BUFFER_BIT);
+static Cmd*
+record(Pg *g, CmdType type, const PgPaint *paint)
+{
+    GL  *gl = GL(g);
+
+    gl->cmds = reserve(gl->cmds, &gl->maxcmds, gl->ncmds + 1, sizeof *gl->cmds);
+
+    Cmd *cmd = gl->cmds + gl->ncmds++;
+    *cmd = (Cmd) {
+        .type = type,
+        .paint = paint? *paint: (PgPaint) { 0 },
+        .gamma = g->s.gamma,
+        .fill_rule = g->s.fill_rule,
+        .flatness = g->s.flatness,
+        .scissor = {
+            (GLint) g->s.clip_x,
+            (GLint) (g->sy - g->s.clip_y - g->s.clip_sy),
+            (GLsizei) g->s.clip_sx,
+            (GLsizei) g->s.clip_sy,
+        },
+    };
+
+    if (gl->limited) {
+        GLint   *s = cmd->scissor;
+        GLint   *r = gl->redraw;
+        GLint   x0 = s[0] > r[0]? s[0]: r[0];
+        GLint   y0 = s[1] > r[1]? s[1]: r[1];
+        GLint   x1 = s[0] + s[2] < r[0] + r[2]? s[0] + s[2]: r[0] + r[2];
+        GLint   y1 = s[1] + s[3] < r[1] + r[3]? s[1] + s[3]: r[1] + r[3];
+
+        s[0] = x0;
+        s[1] = y0;
+        s[2] = x1 > x0? x1 - x0: 0;
+        s[3] = y1 > y0? y1 - y0: 0;
     }
+    return cmd;
 }
 
 
 /*
-    Flatten path into line segments.
-    If `sub[i]` is the start of a subpath, `sub[i+1]` is the exclusive end.
-    `sub[nsubs]` holds the total number of vertices.
-    If a path is closed, the `CLOSED` bit is set on the start index.
+    Copy vertices into the frame, moved by `offset`, and return the
+    index of the first.
 */
-static void
-flatten(Pg *g,
-        PgPt **pverts,
-        unsigned *pnverts,
-        unsigned **psubs,
-        unsigned *pnsubs)
+static unsigned
+append_verts(GL *gl, const PgPt *verts, unsigned n, PgPt offset, Cmd *cmd)
 {
-    PgPt        *verts = malloc(65536 * sizeof *verts);
-    unsigned    *subs = malloc(65536 * sizeof *subs);
-    unsigned    nverts = 0;
-    unsigned    nsubs = 0;
-    PgTM        ctm = g->s.ctm;
-    PgPt        home = pg_mat_apply(ctm, pgpt(0.0f, 0.0f));
-    PgPt        cur = home;
-    PgPath      path = *g->path;
-    float       flatness = (g->s.flatness * 0.5f) * (g->s.flatness * 0.5f);
+    unsigned first = gl->nverts;
 
-    for (unsigned i = 0; i < path.nparts; i++) {
-        if (nverts >= 65536 - (1 << BEZIER_LIMIT))
-            break;
+    gl->verts = reserve(gl->verts, &gl->maxverts, first + n, sizeof *gl->verts);
+    gl->nverts += n;
 
-        PgPt    *pts = path.parts[i].pt;
-        switch (path.parts[i].type) {
-        case PG_PART_MOVE:
-            cur = home = verts[nverts++] = pg_mat_apply(ctm, pts[0]);
-            subs[nsubs++] = nverts - 1;
-            break;
-        case PG_PART_LINE:
-            cur = verts[nverts++] = pg_mat_apply(ctm, pts[0]);
-            break;
-        case PG_PART_CURVE3:
-            nverts += flatten3(verts + nverts,
-                            cur,
-                            pg_mat_apply(ctm, pts[0]),
-                            pg_mat_apply(ctm, pts[1]),
-                            flatness,
-                            BEZIER_LIMIT);
-            cur = pg_mat_apply(ctm, pts[1]);
-            break;
-        case PG_PART_CURVE4:
-            nverts += flatten4(verts + nverts,
-                            cur,
-                            pg_mat_apply(ctm, pts[0]),
-                            pg_mat_apply(ctm, pts[1]),
-                            pg_mat_apply(ctm, pts[2]),
-                            flatness,
-                            BEZIER_LIMIT);
-            cur = pg_mat_apply(ctm, pts[2]);
-            break;
-        case PG_PART_CLOSE:
-            verts[nverts++] = cur = home;
-            if (nsubs)
-                subs[nsubs - 1] |= CLOSED;
-            break;
-        }
+    PgPt *out = gl->verts + first;
+
+    if (offset.x == 0.0f && offset.y == 0.0f)
+        memcpy(out, verts, n * sizeof *verts);
+    else
+        for (unsigned i = 0; i < n; i++)
+            out[i] = add(verts[i], offset);
+
+    PgPt min = out[0];
+    PgPt max = out[0];
+
+    for (unsigned i = 0; i < n; i++) {
+        min.x = fminf(min.x, out[i].x);
+        min.y = fminf(min.y, out[i].y);
+        max.x = fmaxf(max.x, out[i].x);
+        max.y = fmaxf(max.y, out[i].y);
     }
-    subs[nsubs] = nverts;
-    *pverts = verts;
-    *pnverts = nverts;
-    *psubs = subs;
-    *pnsubs = nsubs;
+    cmd->min = min;
+    cmd->max = max;
+
+    return first;
 }
 
 
+/*
+    Layers keep colours multiplied by alpha, with alpha added up, so that
+    they can be drawn over anything afterwards.
+*/
 static void
-_fill(Pg *g)
+set_blend(GL *gl)
 {
-    GL          *gl = GL(g);
-    PgPt        *verts;
-    unsigned    *subs;
-    unsigned    nverts;
-    unsigned    nsubs;
+    if (gl->parent)
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+                            GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    else
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
 
-    if (!g->s.fill || (g->s.fill->nstops == 1 && g->s.fill->colors[0].a == 0.0f))
-        /* Skip everything if colour is transparent. */
-        return;
 
-    flatten(g, &verts, &nverts, &subs, &nsubs);
-    if (!nverts) {
-        free(verts);
-        free(subs);
-        return;
-    }
+static void
+set_coords(Pg *g)
+{
+    GL *gl = GL(g);
 
-    set_coords(g);
-    set_paint(g, g->s.fill);
-
-    /*
-        Draw shape to stencil buffer by fanning triangles from a single vertex.
-        For even-odd fill mode, all the triangles flip the bits under them.
-        For non-zero winding mode, triangles going counter-clockwise increment
-        the stencil, and clockwise decrement.
-        For each, non-zero stencil values are drawn.
-    */
-
-    GLuint src = make_buffer(GL_ARRAY_BUFFER, verts, nverts * sizeof *verts);
-    glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0, 0);
-    glEnableVertexAttribArray(gl->posloc);
+    glEnable(GL_SCISSOR_TEST);
 
-    if (g->s.fill_rule == PG_EVEN_ODD_RULE) {
+    float ctm[] = { 2.0f / g->sx, 0.0f, 0.0f,
+                    0.0f, -2.0f / g->sy, 0.0f,
+                    -1.0f, 1.0f, 0.0f };
 
-        glColorMask(0, 0, 0, 0);
-        glEnable(GL_STENCIL_TEST);
-        glStencilFunc(GL_ALWAYS, 0, 0);
-        glStencilOp(GL_INVERT, GL_INVERT, GL_INVERT);
+    glUseProgram(gl->curveprog);
+    glUniformMatrix3fv(gl->curvectmloc, 1, false, ctm);
+    glUseProgram(gl->layerprog);
+    glUniformMatrix3fv(gl->layerctmloc, 1, false, ctm);
 
-        for (unsigned i = 0; i < nsubs; i++) {
-            int     start = SUB(subs[i]);
-            int     n = SUB(subs[i + 1]) - SUB(subs[i]);
-            glDrawArrays(GL_TRIANGLE_FAN, start, n);
-        }
+    if (gl->patchprog) {
+        glUseProgram(gl->patchprog);
+        glUniformMatrix3fv(gl->patchctmloc, 1, false, ctm);
+        glUniform2f(gl->patchsizeloc, 0.5f * g->sx, 0.5f * g->sy);
+    }
 
-        glColorMask(1.0f, 1.0f, 1.0f, 1.0f);
+    // Programs are shared with layers, which may have bound other paints.
+    for (unsigned i = 0; i < NVARIANTS; i++) {
+        glUseProgram(gl->progs[i].prog);
+        glUniformMatrix3fv(gl->progs[i].ctmloc, 1, false, ctm);
+        gl->progs[i].isbound = false;
+    }
+    glUseProgram(gl->progs[gl->variant].prog);
+    set_blend(gl);
+
+    // Only glyphs have texture coordinates, only rectangles have radii,
+    // and only instances are moved and coloured.
+    glVertexAttrib2f(gl->uvloc, -1.0f, -1.0f);
+    glVertexAttrib2f(gl->radiusloc, -1.0f, -1.0f);
+    glVertexAttrib3f(gl->xformxloc, 1.0f, 0.0f, 0.0f);
+    glVertexAttrib3f(gl->xformyloc, 0.0f, 1.0f, 0.0f);
+    glVertexAttrib4f(gl->colorloc, -1.0f, -1.0f, -1.0f, -1.0f);
+
+    if (gl->ramps) {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, gl->ramps);
+        glActiveTexture(GL_TEXTURE0);
     }
-    else {
 
-        glColorMask(0, 0, 0, 0);
-        glEnable(GL_CULL_FACE);
-        glEnable(GL_STENCIL_TEST);
-        glStencilFunc(GL_ALWAYS, 0, 0);
+    if (gl->atlas) {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, gl->atlas);
+    }
+}
 
-        for (unsigned i = 0; i < nsubs; i++) {
-            unsigned    start = SUB(subs[i]);
-            unsigned    n = SUB(subs[i + 1]) - SUB(subs[i]);
 
-            glCullFace(GL_FRONT);
-            glStencilOp(GL_INCR_WRAP, GL_INCR_WRAP, GL_INCR_WRAP);
-            glDrawArrays(GL_TRIANGLE_FAN, (GLint) start, (GLint) n);
+/*
+    Convert a colour to RGB as it was done per pixel: colours outside the
+    gamut are clamped before gamma correction.
+*/
+static PgColor
+convert(PgColorSpace cspace, PgColor c, float gamma)
+{
+    if (cspace == PG_LCHAB)
+        c = pg_color_lch_to_lab(c);
+
+    if (cspace == PG_LCHAB || cspace == PG_LAB)
+        c = pg_color_lab_to_xyz(c);
+
+    if (cspace == PG_LCHAB || cspace == PG_LAB || cspace == PG_XYZ) {
+        c = pg_color_xyz_to_rgb(c);
+        c = (PgColor) {
+            fminf(fmaxf(c.u, 0.0f), 1.0f),
+            fminf(fmaxf(c.v, 0.0f), 1.0f),
+            fminf(fmaxf(c.w, 0.0f), 1.0f),
+            fminf(fmaxf(c.a, 0.0f), 1.0f),
+        };
+    }
+
+    return pg_color_gamma_correct(c, gamma);
+}
+
 
-            glCullFace(GL_BACK);
-            glStencilOp(GL_DECR_WRAP, GL_DECR_WRAP, GL_DECR_WRAP);
-            glDrawArrays(GL_TRIANGLE_FAN, (GLint) start, (GLint) n);
+/*
+    Return the row of the ramp texture that holds a gradient, converted
+    at RAMP_SIZE points. Gradients are looked up by their stops, colours,
+    and gamma but not where they are drawn. When every row is taken, the
+    least recently used is replaced. This happens as commands are drawn,
+    so anything drawn from the row before has already been issued.
+*/
+static unsigned
+get_ramp(GL *gl, const PgPaint *paint, float gamma)
+{
+    unsigned    n = paint->nstops;
+    uint32_t    hash = hash_bytes(2166136261u, &paint->cspace, sizeof paint->cspace);
+    unsigned    oldest = 0;
+
+    hash = hash_bytes(hash, paint->stops, n * sizeof *paint->stops);
+    hash = hash_bytes(hash, paint->colors, n * sizeof *paint->colors);
+    hash = hash_bytes(hash, &gamma, sizeof gamma);
+
+    for (unsigned i = 0; i < RAMP_ROWS; i++) {
+        Ramp *r = gl->rampcache + i;
+
+        if (r->used &&
+            r->hash == hash &&
+            r->cspace == paint->cspace &&
+            r->nstops == n &&
+            r->gamma == gamma &&
+            !memcmp(r->stops, paint->stops, n * sizeof *r->stops) &&
+            !memcmp(r->colors, paint->colors, n * sizeof *r->colors))
+        {
+            r->used = ++gl->rampuses;
+            return i;
         }
 
-        glDisable(GL_CULL_FACE);
-        glColorMask(1.0f, 1.0f, 1.0f, 1.0f);
+        if (r->used < gl->rampcache[oldest].used)
+            oldest = i;
     }
 
-    glDisableVertexAttribArray(gl->posloc);
-    glDeleteBuffers(1, &src);
+    glActiveTexture(GL_TEXTURE1);
+
+    if (!gl->ramps) {
+        glGenTextures(1, &gl->ramps);
+        glBindTexture(GL_TEXTURE_2D, gl->ramps);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, RAMP_SIZE, RAMP_ROWS, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
 
-    // Draw a quad over mask only placing pixels where the stencil bit is set.
+    GLubyte texels[RAMP_SIZE * 4];
 
-    PgPt min = verts[0];
-    PgPt max = verts[0];
+    for (unsigned i = 0; i < RAMP_SIZE; i++) {
+        PgColor c = convert(paint->cspace,
+                            stopcolor(paint, i / (RAMP_SIZE - 1.0f)),
+                            gamma);
+        float   channels[] = { c.u, c.v, c.w, c.a };
 
-    for (unsigned i = 0; i < nverts; i++) {
-        min.x = fminf(min.x, verts[i].x);
-        min.y = fminf(min.y, verts[i].y);
-        max.x = fmaxf(max.x, verts[i].x);
-        max.y = fmaxf(max.y, verts[i].y);
+        for (unsigned j = 0; j < 4; j++)
+            texels[i * 4 + j] = (GLubyte) (255.0f * fminf(fmaxf(channels[j], 0.0f), 1.0f) + 0.5f);
     }
 
-    GLfloat quadverts[] = {min.x, min.y,
-                           max.x, min.y,
-                           min.x, max.y,
-                           max.x, max.y};
-
-    GLuint quads = make_buffer(GL_ARRAY_BUFFER, quadverts, 8 * sizeof *quadverts);
-    glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0, 0);
-    glEnableVertexAttribArray(gl->posloc);
-
-    glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
-    glStencilFunc(GL_NOTEQUAL, 0, 0xff);
+    glBindTexture(GL_TEXTURE_2D, gl->ramps);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint) oldest, RAMP_SIZE, 1,
+                    GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    glActiveTexture(GL_TEXTURE0);
+
+    Ramp *r = gl->rampcache + oldest;
+
+    *r = (Ramp) {
+        .hash = hash,
+        .used = ++gl->rampuses,
+        .cspace = paint->cspace,
+        .nstops = n,
+        .gamma = gamma,
+    };
+    memcpy(r->stops, paint->stops, n * sizeof *r->stops);
+    memcpy(r->colors, paint->colors, n * sizeof *r->colors);
+    return oldest;
+}
 
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-    glDisableVertexAttribArray(gl->posloc);
-    glDeleteBuffers(1, &quads);
-
-    free(verts);
-    free(subs);
-}
-
-
-// Draw the line segment p1-p2 considering the angle of p0-p1 and p2-p3.
-static inline unsigned
-miter(PgPt w,
-      PgPt p0,
-      PgPt p1,
-      PgPt p2,
-      PgPt p3,
-      PgPt *out,
-      unsigned n)
-{
-    PgPt vp = normalize(sub(p1, p0));
-    PgPt vc = normalize(sub(p2, p1));
-    PgPt vn = normalize(sub(p3, p2));
-    PgPt ni = normalize(add(vp, vc));
-    PgPt no = normalize(add(vc, vn));
-    float mi = 1.0f / dot(ni, vc);
-    float mo = 1.0f / dot(no, vc);
-    PgPt a = sub(p1, mul(perp(ni), scale_pt(w, mi)));
-    PgPt b = add(p1, mul(perp(ni), scale_pt(w, mi)));
-    PgPt c = sub(p2, mul(perp(no), scale_pt(w, mo)));
-    PgPt d = add(p2, mul(perp(no), scale_pt(w, mo)));
-    out[n++] = a, out[n++] = b, out[n++] = c;
-    out[n++] = b, out[n++] = c, out[n++] = d;
-    return n;
-}
-
-
-static inline unsigned
-startcap(PgPt w,
-         PgPt cap,
-         PgPt p1,
-         PgPt p2,
-         PgPt p3,
-         PgPt *out,
-         unsigned n)
-{
-    PgPt vc = normalize(sub(p2, p1));
-    PgPt vn = normalize(sub(p3, p2));
-    PgPt no = normalize(add(vc, vn));
-    float mo = 1.0f / dot(no, vc);
-    PgPt a = sub(sub(p1, mul(perp(vc), w)), mul(vc, cap));
-    PgPt b = sub(add(p1, mul(perp(vc), w)), mul(vc, cap));
-    PgPt c = sub(p2, mul(perp(no), scale_pt(w, mo)));
-    PgPt d = add(p2, mul(perp(no), scale_pt(w, mo)));
-    out[n++] = a, out[n++] = b, out[n++] = c;
-    out[n++] = b, out[n++] = c, out[n++] = d;
-    return n;
-}
-
-
-static inline unsigned
-endcap(PgPt w,
-       PgPt cap,
-       PgPt p0,
-       PgPt p1,
-       PgPt p2,
-       PgPt *out,
-       unsigned n)
-{
-    PgPt vp = normalize(sub(p1, p0));
-    PgPt vc = normalize(sub(p2, p1));
-    PgPt ni = normalize(add(vp, vc));
-    float mi = 1.0f / dot(ni, vc);
-    PgPt a = sub(p1, mul(perp(ni), scale_pt(w, mi)));
-    PgPt b = add(p1, mul(perp(ni), scale_pt(w, mi)));
-    PgPt c = add(sub(p2, mul(perp(vc), w)), mul(vc, cap));
-    PgPt d = add(add(p2, mul(perp(vc), w)), mul(vc, cap));
-    out[n++] = a, out[n++] = b, out[n++] = c;
-    out[n++] = b, out[n++] = c, out[n++] = d;
-    return n;
+static Variant
+variant_of(const PgPaint *paint)
+{
+    return  paint->type == PG_LINEAR_PAINT && paint->nstops > 1?
+                VARIANT_LINEAR:
+                VARIANT_SOLID;
 }
 
 
+/*
+    Switch to the program for a paint and upload the paint as one packed
+    uniform array.
+    Layout (vec4s):
+        0       type, row of the ramp or -1 if solid, scale and offset
+                from the gradient to the ramp
+        1       a, b
+        2       colour if solid
+    Nothing is uploaded if the same values are already bound.
+*/
 static void
-_stroke(Pg *g)
+set_paint(Pg *g, const PgPaint *paint, float gamma)
 {
-    GL          *gl = GL(g);
-    PgPt        *verts;
-    unsigned    *subs;
-    unsigned    nverts;
-    unsigned    nsubs;
+    GL      *gl = GL(g);
+    Variant variant = variant_of(paint);
+    Program *prog = gl->progs + variant;
+    bool    solid = variant == VARIANT_SOLID;
+    PgColor c = solid? convert(paint->cspace, paint->colors[0], gamma): (PgColor) { 0 };
+    float   row = solid? -1.0f: (get_ramp(gl, paint, gamma) + 0.5f) / RAMP_ROWS;
+    GLfloat packed[PAINT_VEC4S * 4] = {
+        (GLfloat) paint->type,
+        row,
+        (RAMP_SIZE - 1.0f) / RAMP_SIZE,
+        0.5f / RAMP_SIZE,
+        paint->a.x, g->sy - paint->a.y,
+        paint->b.x, g->sy - paint->b.y,
+        c.u, c.v, c.w, c.a,
+    };
+
+    if (variant != gl->variant) {
+        glUseProgram(prog->prog);
+        gl->variant = variant;
+    }
 
-    flatten(g, &verts, &nverts, &subs, &nsubs);
+    if (prog->isbound && !memcmp(packed, prog->bound, sizeof packed))
+        return;
 
-    // Line width is not in device coordinates, so scale it with CTM.
-    PgTM    strokectm = { g->s.ctm.a, g->s.ctm.b, g->s.ctm.c, g->s.ctm.d, 0.0f, 0.0f };
-    float   lw = 0.5f * g->s.line_width;
-    PgPt    w = pg_mat_apply(strokectm, pgpt(lw, lw));
+    glUniform4fv(prog->paintloc, PAINT_VEC4S, packed);
+    memcpy(prog->bound, packed, sizeof packed);
+    prog->isbound = true;
+}
 
-    PgPt    cap = g->s.line_cap == PG_BUTT_CAP? pgpt(0.0f, 0.0f):
-                  g->s.line_cap == PG_SQUARE_CAP? w:
-                  pgpt(0.0f, 0.0f);
 
+// Only change the GL state that differs from the last command drawn.
+static void
+set_state(Pg *g, const Cmd *cmd, const Cmd *last)
+{
+    if (!last || memcmp(cmd->scissor, last->scissor, sizeof cmd->scissor))
+        glScissor(cmd->scissor[0], cmd->scissor[1],
+                  cmd->scissor[2], cmd->scissor[3]);
 
-    // Construct each subpath.
+    // Instances have their own colours, and layers their own program.
+    if (cmd->type != CMD_CLEAR && cmd->type != CMD_INSTANCES && cmd->type != CMD_LAYER)
+        set_paint(g, &cmd->paint, cmd->gamma);
+}
 
-    PgPt        *final = malloc(6 * nverts * sizeof *final);
-    unsigned    nfinal = 0;
 
-    for (unsigned s = 0; s < nsubs; s++) {
-        bool        closed = subs[s] & CLOSED;
-        unsigned    start = SUB(subs[s]);
-        unsigned    end = SUB(subs[s + 1]);
+// Whether a command can be drawn without switching programs.
+static bool
+uses_variant(const Cmd *cmd, Variant variant)
+{
+    return  cmd->type == CMD_INSTANCES ||
+            cmd->type == CMD_LAYER ||
+            variant_of(&cmd->paint) == variant;
+}
 
-        if (closed) {
-            // There are no caps on this line.
-            end -= 1;
-            nfinal = miter(w,
-                            verts[end - 1], verts[start],
-                            verts[start + 1], verts[start + 2],
-                            final, nfinal);
 
-            for (unsigned i = start + 1; i + 2 <= end; i++)
-                nfinal = miter(w,
-                                verts[i - 1], verts[i],
-                                verts[i + 1], verts[i + 2],
-                                final, nfinal);
+/*
+    Choose the next command to draw, starting from `cmds[first]`, the
+    first not yet drawn. A later command that can be drawn with the
+    program in use is taken instead if it does not overlap anything it
+    would jump over.
+*/
+static unsigned
+pick_lead(GL *gl, unsigned first, const bool *done)
+{
+    const Cmd   *cmds = gl->cmds;
+    unsigned    skipped[SWITCH_LOOKAHEAD];
+    unsigned    nskipped = 0;
+
+    for (unsigned j = first; j < gl->ncmds && nskipped < SWITCH_LOOKAHEAD; j++) {
+        if (done[j])
+            continue;
+
+        if (cmds[j].type == CMD_CLEAR)
+            break;
+
+        bool ok = uses_variant(&cmds[j], gl->variant);
+
+        for (unsigned k = 0; ok && k < nskipped; k++)
+            ok = !overlaps(&cmds[j], &cmds[skipped[k]]);
+
+        if (ok)
+            return j;
+
+        skipped[nskipped++] = j;
+    }
+
+    return first;
+}
+
+
+/*
+    Collect the commands that can be drawn along with `cmds[lead]`.
+    A later command can be moved up if it draws the same way and does not
+    overlap anything it would jump over, including anything from
+    `cmds[first]` that the lead was moved up past. Fills merged into one
+    stencil pass must not overlap each other either, otherwise their
+    coverage would be combined.
+*/
+static unsigned
+gather(GL *gl, unsigned first, unsigned lead, bool *done, unsigned *group)
+{
+    const Cmd   *cmds = gl->cmds;
+    unsigned    ngroup = 0;
+    unsigned    nblocked = 0;
+    unsigned    *blocked = group + LOOKAHEAD + 1;
+
+    group[ngroup++] = lead;
+    done[lead] = true;
+
+    if (cmds[lead].type == CMD_CLEAR ||
+        cmds[lead].type == CMD_INSTANCES ||
+        cmds[lead].type == CMD_LAYER)
+        return ngroup;
+
+    for (unsigned j = first; j < lead; j++)
+        if (!done[j])
+            blocked[nblocked++] = j;
+
+    for (unsigned j = lead + 1; j < gl->ncmds && j <= first + LOOKAHEAD; j++) {
+        if (done[j])
+            continue;
+
+        if (cmds[j].type == CMD_CLEAR)
+            break;
+
+        bool ok = same_state(&cmds[lead], &cmds[j]);
+
+        for (unsigned k = 0; ok && k < nblocked; k++)
+            ok = !overlaps(&cmds[j], &cmds[blocked[k]]);
+
+        for (unsigned k = 0; ok && cmds[j].type == CMD_FILL && k < ngroup; k++)
+            ok = !overlaps(&cmds[j], &cmds[group[k]]);
+
+        if (ok) {
+            group[ngroup++] = j;
+            done[j] = true;
+        }
+        else
+            blocked[nblocked++] = j;
+    }
+
+    return ngroup;
+}
+
+
+// Point the vertex attributes at the textured vertices or back again.
+static void
+bind_quads(GL *gl, bool quads)
+{
+    if (quads) {
+        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 4 * sizeof(GLfloat),
+                              (const void*) gl->quadoffset);
+        glVertexAttribPointer(gl->uvloc, 2, GL_FLOAT, 0, 4 * sizeof(GLfloat),
+                              (const void*) (gl->quadoffset + 2 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(gl->uvloc);
+    }
+    else {
+        glDisableVertexAttribArray(gl->uvloc);
+        glVertexAttrib2f(gl->uvloc, -1.0f, -1.0f);
+        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0,
+                              (const void*) gl->vertoffset);
+    }
+}
+
+
+// Point the vertex attributes at the unit square and rectangles or back again.
+static void
+bind_rects(GL *gl, bool rects)
+{
+    if (rects) {
+        glBindBuffer(GL_ARRAY_BUFFER, gl->corners);
+        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, gl->ring);
+        glVertexAttribDivisor(gl->rectloc, 1);
+        glVertexAttribDivisor(gl->radiusloc, 1);
+        glEnableVertexAttribArray(gl->rectloc);
+        glEnableVertexAttribArray(gl->radiusloc);
+    }
+    else {
+        glDisableVertexAttribArray(gl->rectloc);
+        glDisableVertexAttribArray(gl->radiusloc);
+        glVertexAttribDivisor(gl->rectloc, 0);
+        glVertexAttribDivisor(gl->radiusloc, 0);
+        glVertexAttrib2f(gl->radiusloc, -1.0f, -1.0f);
+        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0,
+                              (const void*) gl->vertoffset);
+    }
+}
+
+
+// Point the vertex attributes at the fringes of edges or back again.
+static void
+bind_fringes(GL *gl, bool fringes)
+{
+    if (fringes) {
+        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 6 * sizeof(GLfloat),
+                              (const void*) gl->fringeoffset);
+        glVertexAttribPointer(gl->rectloc, 4, GL_FLOAT, 0, 6 * sizeof(GLfloat),
+                              (const void*) (gl->fringeoffset + 2 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(gl->rectloc);
+        glVertexAttrib2f(gl->radiusloc, -2.0f, -2.0f);
+    }
+    else {
+        glDisableVertexAttribArray(gl->rectloc);
+        glVertexAttrib2f(gl->radiusloc, -1.0f, -1.0f);
+        glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0,
+                              (const void*) gl->vertoffset);
+    }
+}
+
+
+// Point the instance attributes at the instances of a command or back again.
+static void
+bind_instances(GL *gl, const Cmd *cmd)
+{
+    GLint       locs[] = { gl->xformxloc, gl->xformyloc, gl->colorloc };
+    GLint       sizes[] = { 3, 3, 4 };
+    GLintptr    at = cmd? gl->instanceoffset + (GLintptr) (cmd->instances * 10 * sizeof(GLfloat)): 0;
+
+    for (unsigned i = 0; i < 3; i++) {
+        if (cmd) {
+            glVertexAttribPointer(locs[i], sizes[i], GL_FLOAT, 0, 10 * sizeof(GLfloat),
+                                  (const void*) at);
+            glVertexAttribDivisor(locs[i], 1);
+            glEnableVertexAttribArray(locs[i]);
+            at += sizes[i] * sizeof(GLfloat);
+        }
+        else
+            glDisableVertexAttribArray(locs[i]);
+    }
+
+    if (!cmd) {
+        glVertexAttrib3f(gl->xformxloc, 1.0f, 0.0f, 0.0f);
+        glVertexAttrib3f(gl->xformyloc, 0.0f, 1.0f, 0.0f);
+        glVertexAttrib4f(gl->colorloc, -1.0f, -1.0f, -1.0f, -1.0f);
+    }
+}
+
+
+/*
+    Draw ranges of rectangles with as few calls as possible.
+    Each range is drawn as instances of the unit square.
+*/
+static void
+draw_rects(GL *gl, const unsigned *first, const unsigned *count, unsigned n)
+{
+    unsigned i = 0;
+
+    while (i < n) {
+        unsigned    start = first[i];
+        unsigned    end = first[i] + count[i];
+        GLintptr    at = gl->rectoffset + (GLintptr) (start * 6 * sizeof(GLfloat));
+
+        for (i++; i < n && first[i] == end; i++)
+            end += count[i];
+
+        glVertexAttribPointer(gl->rectloc, 4, GL_FLOAT, 0, 6 * sizeof(GLfloat),
+                              (const void*) at);
+        glVertexAttribPointer(gl->radiusloc, 2, GL_FLOAT, 0, 6 * sizeof(GLfloat),
+                              (const void*) (at + 4 * sizeof(GLfloat)));
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, (GLsizei) (end - start));
+    }
+}
+
+
+/*
+    Draw ranges of vertices with as few calls as possible.
+    Ranges that follow on from each other are drawn together.
+*/
+static void
+draw_runs(GLenum mode, const unsigned *first, const unsigned *count, unsigned n)
+{
+    unsigned i = 0;
+
+    while (i < n) {
+        unsigned start = first[i];
+        unsigned end = first[i] + count[i];
+
+        for (i++; i < n && first[i] == end; i++)
+            end += count[i];
+
+        glDrawArrays(mode, (GLint) start, (GLsizei) (end - start));
+    }
+}
+
+
+/*
+    Draw the fans of a group of fills.
+    Commands recorded one after another have their fans next to each
+    other, so they are drawn with one call.
+*/
+static void
+draw_fans(GL *gl, const unsigned *group, unsigned n)
+{
+    unsigned i = 0;
+
+    while (i < n) {
+        unsigned start = gl->cmds[group[i]].first;
+        unsigned end = start + gl->cmds[group[i]].count;
+
+        for (i++; i < n && gl->cmds[group[i]].first == end; i++)
+            end += gl->cmds[group[i]].count;
+
+        if (end > start)
+            glMultiDrawArrays(GL_TRIANGLE_FAN,
+                              gl->fanfirst + start,
+                              gl->fancount + start,
+                              (GLsizei) (end - start));
+    }
+}
+
+
+static void
+draw_group(Pg *g, const unsigned *group, unsigned n)
+{
+    GL          *gl = GL(g);
+    const Cmd   *cmd = gl->cmds + group[0];
+    unsigned    *first = gl->first;
+    unsigned    *count = gl->count;
+
+    switch (cmd->type) {
+
+    case CMD_CLEAR:
+        {
+            PgColor c = pg_color_to_rgb(cmd->paint.cspace,
+                                        cmd->paint.colors[0],
+                                        cmd->gamma);
+            if (gl->parent)
+                glClearColor(c.u * c.a, c.v * c.a, c.w * c.a, c.a);
+            else
+                glClearColor(c.u, c.v, c.w, c.a);
+            glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        }
+        break;
+
+    case CMD_TRIANGLES:
+        for (unsigned i = 0; i < n; i++) {
+            first[i] = gl->cmds[group[i]].first;
+            count[i] = gl->cmds[group[i]].count;
+        }
+        glDisable(GL_STENCIL_TEST);
+        draw_runs(GL_TRIANGLES, first, count, n);
+        break;
+
+    case CMD_GLYPHS:
+        for (unsigned i = 0; i < n; i++) {
+            first[i] = gl->cmds[group[i]].first;
+            count[i] = gl->cmds[group[i]].count;
+        }
+        glDisable(GL_STENCIL_TEST);
+        bind_quads(gl, true);
+        draw_runs(GL_TRIANGLES, first, count, n);
+        bind_quads(gl, false);
+        break;
+
+    case CMD_RECTS:
+        for (unsigned i = 0; i < n; i++) {
+            first[i] = gl->cmds[group[i]].first;
+            count[i] = gl->cmds[group[i]].count;
+        }
+        glDisable(GL_STENCIL_TEST);
+        bind_rects(gl, true);
+        draw_rects(gl, first, count, n);
+        bind_rects(gl, false);
+        break;
+
+    case CMD_LAYER:
+        glDisable(GL_STENCIL_TEST);
+        glUseProgram(gl->layerprog);
+        glUniform1f(gl->opacityloc, cmd->opacity);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, cmd->texture);
+        glActiveTexture(GL_TEXTURE0);
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        bind_quads(gl, true);
+        glDrawArrays(GL_TRIANGLES, (GLint) cmd->first, (GLsizei) cmd->count);
+        bind_quads(gl, false);
+        set_blend(gl);
+        glUseProgram(gl->progs[gl->variant].prog);
+        break;
+
+    case CMD_INSTANCES:
+        glDisable(GL_STENCIL_TEST);
+        bind_instances(gl, cmd);
+        glDrawArraysInstanced(GL_TRIANGLES, (GLint) cmd->first, (GLsizei) cmd->count,
+                              (GLsizei) cmd->ninstances);
+        bind_instances(gl, 0);
+        break;
+
+    case CMD_FILL:
+
+        /*
+            Draw shape to stencil buffer by fanning triangles from a single vertex.
+            For even-odd fill mode, all the triangles flip the bits under them.
+            For non-zero winding mode, triangles going counter-clockwise increment
+            the stencil, and clockwise decrement. Both are done in one pass
+            with separate operations for each face.
+            The triangles of strokes just set the stencil wherever they are.
+            For each, non-zero stencil values are drawn.
+        */
+
+        glColorMask(0, 0, 0, 0);
+        glEnable(GL_STENCIL_TEST);
+
+        if (cmd->stroke) {
+            for (unsigned i = 0; i < n; i++) {
+                first[i] = gl->cmds[group[i]].first;
+                count[i] = gl->cmds[group[i]].count;
+            }
+            glStencilFunc(GL_ALWAYS, 1, 0xff);
+            glStencilOp(GL_REPLACE, GL_REPLACE, GL_REPLACE);
+            draw_runs(GL_TRIANGLES, first, count, n);
+        }
+        else {
+            glStencilFunc(GL_ALWAYS, 0, 0);
+
+            if (cmd->fill_rule == PG_EVEN_ODD_RULE)
+                glStencilOp(GL_INVERT, GL_INVERT, GL_INVERT);
+            else {
+                glStencilOpSeparate(GL_BACK, GL_INCR_WRAP, GL_INCR_WRAP, GL_INCR_WRAP);
+                glStencilOpSeparate(GL_FRONT, GL_DECR_WRAP, GL_DECR_WRAP, GL_DECR_WRAP);
+            }
+
+            draw_fans(gl, group, n);
+        }
+
+        // Add the parts of implicit curves that bulge out of the fans.
+
+        unsigned ncurves = 0;
+
+        for (unsigned i = 0; i < n; i++)
+            if (gl->cmds[group[i]].ncurves) {
+                first[ncurves] = gl->cmds[group[i]].curves;
+                count[ncurves++] = gl->cmds[group[i]].ncurves;
+            }
+
+        if (ncurves) {
+            glUseProgram(gl->curveprog);
+            bind_quads(gl, true);
+            draw_runs(GL_TRIANGLES, first, count, ncurves);
+            bind_quads(gl, false);
+            glUseProgram(gl->progs[gl->variant].prog);
+        }
+
+        // Add curves flattened by the geometry shader.
+
+        unsigned npatches = 0;
+
+        for (unsigned i = 0; i < n; i++)
+            if (gl->cmds[group[i]].npatches) {
+                first[npatches] = gl->cmds[group[i]].patches;
+                count[npatches++] = gl->cmds[group[i]].npatches;
+            }
+
+        if (npatches) {
+            glUseProgram(gl->patchprog);
+            glUniform1f(gl->patchtolloc, tolerance_of(cmd->flatness));
+            draw_runs(GL_LINES_ADJACENCY, first, count, npatches);
+            glUseProgram(gl->progs[gl->variant].prog);
+        }
+
+        glColorMask(1.0f, 1.0f, 1.0f, 1.0f);
+
+        // Antialias edges from the outside, marking the top bit of the
+        // stencil so that each pixel is blended once.
+
+        unsigned nfringes = 0;
+
+        for (unsigned i = 0; i < n; i++)
+            if (gl->cmds[group[i]].nfringe) {
+                first[nfringes] = gl->cmds[group[i]].fringe;
+                count[nfringes++] = gl->cmds[group[i]].nfringe;
+            }
+
+        if (nfringes) {
+            glStencilFunc(GL_EQUAL, 0, 0xff);
+            glStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
+            glStencilMask(0x80);
+            bind_fringes(gl, true);
+            draw_runs(GL_TRIANGLES, first, count, nfringes);
+            bind_fringes(gl, false);
+            glStencilMask(0xff);
+        }
+
+        // Draw quads over mask only placing pixels where the stencil bit is set.
+        // The cover reaches past any fringe, so it clears the marks too.
+
+        for (unsigned i = 0; i < n; i++) {
+            first[i] = gl->nverts + gl->cmds[group[i]].cover;
+            count[i] = 6;
+        }
+
+        glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
+        glStencilFunc(GL_NOTEQUAL, 0, 0x7f);
+        draw_runs(GL_TRIANGLES, first, count, n);
+        break;
+    }
+}
+
+
+/*
+    Add what a command can touch to the bounds drawn since the commit.
+    Clears cover their whole scissor.
+*/
+static void
+add_damage(Pg *g, const Cmd *cmd)
+{
+    GL          *gl = GL(g);
+    const GLint *s = cmd->scissor;
+    PgPt        min = pgpt(s[0], g->sy - s[1] - s[3]);
+    PgPt        max = pgpt(s[0] + s[2], g->sy - s[1]);
+
+    if (cmd->type != CMD_CLEAR) {
+        min = pgpt(fmaxf(min.x, floorf(cmd->min.x)), fmaxf(min.y, floorf(cmd->min.y)));
+        max = pgpt(fminf(max.x, ceilf(cmd->max.x)), fminf(max.y, ceilf(cmd->max.y)));
+    }
+
+    if (min.x >= max.x || min.y >= max.y)
+        return;
+
+    gl->drawnmin = pgpt(fminf(gl->drawnmin.x, min.x), fminf(gl->drawnmin.y, min.y));
+    gl->drawnmax = pgpt(fmaxf(gl->drawnmax.x, max.x), fmaxf(gl->drawnmax.y, max.y));
+}
+
+
+/*
+    Draw everything recorded since the last flush.
+    All vertices are uploaded together, then commands are drawn in order
+    except that compatible commands are pulled together where it does not
+    change the result.
+*/
+static void
+flush(Pg *g)
+{
+    GL          *gl = GL(g);
+    unsigned    ncmds = gl->ncmds;
+
+    // The parent has to draw this layer before it changes.
+    if (gl->pending && gl->parent->epoch == gl->drawnepoch)
+        flush((Pg*) gl->parent);
+    gl->pending = false;
+
+    if (!ncmds)
+        return;
+
+    GLint   oldfbo = 0;
+    GLint   oldviewport[4];
+
+    if (gl->fbo) {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldfbo);
+        glGetIntegerv(GL_VIEWPORT, oldviewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, gl->fbo);
+        glViewport(0, 0, (GLsizei) g->sx, (GLsizei) g->sy);
+    }
+
+    upload(gl);
+
+    set_coords(g);
+    glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0, (const void*) gl->vertoffset);
+    glEnableVertexAttribArray(gl->posloc);
+
+    gl->done = reserve(gl->done, &gl->maxdone, ncmds, sizeof *gl->done);
+    memset(gl->done, 0, ncmds * sizeof *gl->done);
+
+    bool        *done = gl->done;
+    unsigned    *group = gl->group;
+    const Cmd   *last = 0;
+
+    for (unsigned i = 0; i < ncmds; i++)
+        add_damage(g, gl->cmds + i);
+
+    for (unsigned i = 0; i < ncmds; ) {
+        if (done[i]) {
+            i++;
+            continue;
+        }
+
+        unsigned lead = pick_lead(gl, i, done);
+        unsigned n = gather(gl, i, lead, done, group);
+
+        set_state(g, gl->cmds + lead, last);
+        draw_group(g, group, n);
+        last = gl->cmds + lead;
+    }
+
+    glDisableVertexAttribArray(gl->posloc);
+
+    if (gl->fbo) {
+        glBindFramebuffer(GL_FRAMEBUFFER, (GLuint) oldfbo);
+        glViewport(oldviewport[0], oldviewport[1], oldviewport[2], oldviewport[3]);
+    }
+
+    gl->ncmds = 0;
+    gl->nverts = 0;
+    gl->ncovers = 0;
+    gl->nfans = 0;
+    gl->nquads = 0;
+    gl->nrects = 0;
+    gl->ninstances = 0;
+    gl->nfringes = 0;
+    gl->epoch++;
+}
+
+
+/*
+    Empty the glyph cache.
+    Anything drawn from it must be flushed first.
+*/
+static void
+drop_glyphs(GL *gl)
+{
+    glDeleteTextures(1, &gl->atlas);
+    pg_canvas_free(gl->raster);
+    free(gl->shelves);
+    free(gl->glyphs);
+
+    gl->atlas = 0;
+    gl->raster = 0;
+    gl->shelves = 0;
+    gl->nshelves = gl->maxshelves = 0;
+    gl->glyphs = 0;
+    gl->nglyphs = gl->maxglyphs = 0;
+}
+
+
+static void
+drop_paths(GL *gl)
+{
+    for (PathEntry *e = gl->newest, *next; e; e = next) {
+        next = e->older;
+        free(e);
+    }
+
+    free(gl->paths);
+    gl->paths = 0;
+    gl->npaths = gl->maxpaths = 0;
+    gl->newest = gl->oldest = 0;
+    gl->pathsize = 0;
+}
+
+
+static void
+unlink_path(GL *gl, PathEntry *e)
+{
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        gl->newest = e->older;
+
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        gl->oldest = e->newer;
+}
+
+
+static void
+link_path(GL *gl, PathEntry *e)
+{
+    e->newer = 0;
+    e->older = gl->newest;
+
+    if (gl->newest)
+        gl->newest->newer = e;
+    else
+        gl->oldest = e;
+    gl->newest = e;
+}
+
+
+static void
+evict_path(GL *gl, PathEntry *e)
+{
+    PathEntry **link = gl->paths + (e->hash & (gl->maxpaths - 1));
+
+    while (*link != e)
+        link = &(*link)->chain;
+    *link = e->chain;
+
+    unlink_path(gl, e);
+    gl->npaths--;
+    gl->pathsize -= e->size;
+    free(e);
+}
+
+
+static void
+grow_paths(GL *gl)
+{
+    if (gl->npaths < gl->maxpaths)
+        return;
+
+    unsigned    max = gl->maxpaths? 2 * gl->maxpaths: 64;
+    PathEntry   **paths = calloc(max, sizeof *paths);
+
+    for (PathEntry *e = gl->newest; e; e = e->older) {
+        e->chain = paths[e->hash & (max - 1)];
+        paths[e->hash & (max - 1)] = e;
+    }
+
+    free(gl->paths);
+    gl->paths = paths;
+    gl->maxpaths = max;
+}
+
+
+/*
+    Remember a flattened path.
+    The least recently used paths are dropped to keep within the cap.
+*/
+static void
+cache_path(GL *gl, uint32_t hash, const PgPath *path, PgTM ctm, float flatness, const Flat *flat)
+{
+    size_t  psize = path->nparts * sizeof *path->parts;
+    size_t  vsize = flat->nverts * sizeof *flat->verts;
+    size_t  ssize = (flat->nsubs + 1) * sizeof *flat->subs;
+    size_t  size = sizeof(PathEntry) + psize + vsize + ssize;
+
+    if (size > gl->pathcap)
+        return;
+
+    while (gl->oldest && gl->pathsize + size > gl->pathcap)
+        evict_path(gl, gl->oldest);
+
+    grow_paths(gl);
+
+    PathEntry   *e = malloc(size);
+    uint8_t     *data = (uint8_t*) (e + 1);
+
+    *e = (PathEntry) {
+        .hash = hash,
+        .linear = { ctm.a, ctm.b, ctm.c, ctm.d },
+        .flatness = flatness,
+        .origin = pgpt(ctm.e, ctm.f),
+        .size = size,
+        .parts = memcpy(data, path->parts, psize),
+        .nparts = path->nparts,
+        .verts = memcpy(data + psize, flat->verts, vsize),
+        .nverts = flat->nverts,
+        .subs = memcpy(data + psize + vsize, flat->subs, ssize),
+        .nsubs = flat->nsubs,
+    };
+
+    e->chain = gl->paths[hash & (gl->maxpaths - 1)];
+    gl->paths[hash & (gl->maxpaths - 1)] = e;
+    link_path(gl, e);
+    gl->npaths++;
+    gl->pathsize += size;
+}
+
+
+/*
+    Flatten the current path or find it in the cache.
+    Paths are looked up by their parts, the linear part of the CTM, and
+    the flatness, so a path drawn again elsewhere is only moved.
+    The result is valid until the next call.
+*/
+static void
+get_flat(Pg *g, Flat *flat)
+{
+    GL          *gl = GL(g);
+    Scratch     *scratch = &gl->scratch;
+    PgPath      *path = g->path;
+    PgTM        ctm = g->s.ctm;
+    float       flatness = g->s.flatness;
+    uint32_t    h = 0;
+
+    if (gl->pathcap) {
+        h = hash_bytes(2166136261u, path->parts, path->nparts * sizeof *path->parts);
+        h = hash_bytes(h, &ctm, 4 * sizeof ctm.a);
+        h = hash_bytes(h, &flatness, sizeof flatness);
+
+        PathEntry *e = gl->maxpaths? gl->paths[h & (gl->maxpaths - 1)]: 0;
+
+        for ( ; e; e = e->chain)
+            if (e->hash == h &&
+                e->linear[0] == ctm.a && e->linear[1] == ctm.b &&
+                e->linear[2] == ctm.c && e->linear[3] == ctm.d &&
+                e->flatness == flatness &&
+                e->nparts == path->nparts &&
+                !memcmp(e->parts, path->parts, path->nparts * sizeof *path->parts))
+                break;
+
+        if (e) {
+            gl->pathhits++;
+            unlink_path(gl, e);
+            link_path(gl, e);
+
+            *flat = (Flat) {
+                .verts = e->verts,
+                .nverts = e->nverts,
+                .subs = e->subs,
+                .nsubs = e->nsubs,
+                .offset = pgpt(ctm.e - e->origin.x, ctm.f - e->origin.y),
+            };
+            return;
+        }
+
+        gl->pathmisses++;
+    }
+
+    flatten(g, scratch, &flat->nverts, &flat->nsubs);
+    *flat = (Flat) {
+        .verts = scratch->verts,
+        .nverts = flat->nverts,
+        .subs = scratch->subs,
+        .nsubs = flat->nsubs,
+    };
+
+    if (gl->pathcap)
+        cache_path(gl, h, path, ctm, flatness, flat);
+}
+
+
+/*
+    Work out the rectangle to read in the GL's coordinates,
+    which start at the bottom. It must lie inside the canvas.
+*/
+static bool
+read_rect(Pg *g, float x, float y, float sx, float sy, GLint *rect)
+{
+    float x0 = floorf(x);
+    float y0 = floorf(y);
+    float x1 = ceilf(x + sx);
+    float y1 = ceilf(y + sy);
+
+    if (x0 < 0.0f || y0 < 0.0f || x1 > g->sx || y1 > g->sy || x1 <= x0 || y1 <= y0)
+        return false;
+
+    rect[0] = (GLint) x0;
+    rect[1] = (GLint) (g->sy - y1);
+    rect[2] = (GLint) (x1 - x0);
+    rect[3] = (GLint) (y1 - y0);
+    return true;
+}
+
+
+/*
+    Draw what has been recorded and read the rectangle into `pixels`,
+    which is a pixel buffer offset if one is bound.
+*/
+static void
+read_pixels(Pg *g, const GLint *rect, void *pixels)
+{
+    GL      *gl = GL(g);
+    GLint   oldfbo = 0;
+
+    flush(g);
+
+    if (gl->fbo) {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldfbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, gl->fbo);
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(rect[0], rect[1], rect[2], rect[3],
+                 GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+    if (gl->fbo)
+        glBindFramebuffer(GL_FRAMEBUFFER, (GLuint) oldfbo);
+}
+
+
+/*
+    Copy rows read from the bottom up so that they go from the top down.
+*/
+static void
+flip_rows(uint8_t *dst, const uint8_t *src, unsigned width, unsigned height)
+{
+    size_t  stride = (size_t) width * 4;
+
+    for (unsigned y = 0; y < height; y++)
+        memcpy(dst + (height - 1 - y) * stride, src + y * stride, stride);
+}
+
+
+static bool
+read_done(GL *gl, const Readback *read)
+{
+    // Without a fence, give the GL a whole frame.
+    if (!read->fence)
+        return read->commit + 1 < gl->commits;
+
+    GLenum status = glClientWaitSync(read->fence, 0, 0);
+    return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+
+/*
+    Give the callbacks the pixels of reads in the order they were made.
+    Unless `wait` is set, stop at the first read the GL has not finished.
+    Each read leaves the queue before its callback is called so that the
+    callback can read again.
+*/
+static void
+deliver_reads(GL *gl, bool wait)
+{
+    while (gl->nreads && (wait || read_done(gl, gl->reads))) {
+        Readback    read = gl->reads[0];
+        size_t      size = (size_t) read.width * read.height * 4;
+
+        memmove(gl->reads, gl->reads + 1, --gl->nreads * sizeof *gl->reads);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, read.pbo);
+
+        const uint8_t *src = gl->mappable
+            ? glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr) size,
+                               GL_MAP_READ_BIT)
+            : glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        uint8_t *pixels = 0;
+
+        if (src) {
+            gl->readrows = reserve(gl->readrows, &gl->maxreadrows,
+                                   (unsigned) size, 1);
+            pixels = gl->readrows;
+            flip_rows(pixels, src, read.width, read.height);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        if (read.fence)
+            glDeleteSync(read.fence);
+
+        gl->spares = reserve(gl->spares, &gl->maxspares,
+                             gl->nspares + 1, sizeof *gl->spares);
+        gl->spares[gl->nspares++] = read.pbo;
+
+        read.callback(read.data, pixels, read.width, read.height);
+    }
+}
+
+
+#ifdef USE_EGL
+static EGLDisplay   egl_display;
+static EGLContext   egl_context;
+static EGLSurface   egl_surface;
+static unsigned     egl_users;
+
+
+static bool
+has_extension(const char *list, const char *name)
+{
+    size_t  n = strlen(name);
+
+    for (const char *p = list; p && (p = strstr(p, name)); p += n)
+        if ((p == list || p[-1] == ' ') && (p[n] == ' ' || p[n] == 0))
+            return true;
+    return false;
+}
+
+
+/*
+    Make the context of offscreen canvases current, creating it for the
+    first. The surfaceless platform needs no display server at all.
+    Otherwise, the default display is used with a tiny pbuffer unless
+    contexts can be made current without a surface.
+*/
+static bool
+start_egl(void)
+{
+    if (egl_users) {
+        if (!eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+            return false;
+        egl_users++;
+        return true;
+    }
+
+    const char  *client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = 0;
+
+    if (has_extension(client, "EGL_EXT_platform_base") &&
+        has_extension(client, "EGL_MESA_platform_surfaceless"))
+    {
+        get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+            eglGetProcAddress("eglGetPlatformDisplayEXT");
+    }
+
+    egl_display = get_platform_display
+        ? get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0)
+        : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, 0, 0))
+        return false;
+
+    const char  *ext = eglQueryString(egl_display, EGL_EXTENSIONS);
+    bool        surfaceless = has_extension(ext, "EGL_KHR_surfaceless_context");
+    EGLint      attrs[] = {
+        EGL_RENDERABLE_TYPE,    EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE,       surfaceless? 0: EGL_PBUFFER_BIT,
+        EGL_NONE,
+    };
+    EGLint      pbuffer[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    EGLConfig   conf;
+    EGLint      nconfs = 0;
+
+    if (eglBindAPI(EGL_OPENGL_API) &&
+        eglChooseConfig(egl_display, attrs, &conf, 1, &nconfs) &&
+        nconfs)
+    {
+        egl_context = eglCreateContext(egl_display, conf, EGL_NO_CONTEXT, 0);
+        if (!surfaceless)
+            egl_surface = eglCreatePbufferSurface(egl_display, conf, pbuffer);
+    }
+
+    if (egl_context == EGL_NO_CONTEXT ||
+        (!surfaceless && egl_surface == EGL_NO_SURFACE) ||
+        !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+    {
+        if (egl_surface != EGL_NO_SURFACE)
+            eglDestroySurface(egl_display, egl_surface);
+        if (egl_context != EGL_NO_CONTEXT)
+            eglDestroyContext(egl_display, egl_context);
+        eglTerminate(egl_display);
+        egl_display = EGL_NO_DISPLAY;
+        egl_context = EGL_NO_CONTEXT;
+        egl_surface = EGL_NO_SURFACE;
+        return false;
+    }
+
+    egl_users = 1;
+    return true;
+}
+
+
+static void
+stop_egl(void)
+{
+    if (--egl_users)
+        return;
+
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (egl_surface != EGL_NO_SURFACE)
+        eglDestroySurface(egl_display, egl_surface);
+    eglDestroyContext(egl_display, egl_context);
+    eglTerminate(egl_display);
+    egl_display = EGL_NO_DISPLAY;
+    egl_context = EGL_NO_CONTEXT;
+    egl_surface = EGL_NO_SURFACE;
+}
+#endif
+
+
+static void
+_free(Pg *g)
+{
+    GL *gl = GL(g);
+
+    flush(g);
+    // Nothing read is lost.
+    deliver_reads(gl, true);
+    glDeleteBuffers((GLsizei) gl->nspares, gl->spares);
+
+    drop_glyphs(gl);
+    drop_paths(gl);
+
+    // Layers share their parent's programs.
+    if (!gl->parent) {
+        for (unsigned i = 0; i < NVARIANTS; i++) {
+            glDeleteShader(gl->progs[i].fsh);
+            glDeleteProgram(gl->progs[i].prog);
+        }
+        glDeleteShader(gl->vsh);
+        glDeleteShader(gl->curvefsh);
+        glDeleteProgram(gl->curveprog);
+        glDeleteShader(gl->layerfsh);
+        glDeleteProgram(gl->layerprog);
+
+        if (gl->patchprog) {
+            glDeleteShader(gl->patchvsh);
+            glDeleteShader(gl->patchgsh);
+            glDeleteShader(gl->patchfsh);
+            glDeleteProgram(gl->patchprog);
+        }
+        glDeleteBuffers(1, &gl->corners);
+    }
+    glDeleteFramebuffers(1, &gl->fbo);
+    glDeleteRenderbuffers(1, &gl->color);
+    glDeleteRenderbuffers(1, &gl->stencil);
+    glDeleteTextures(1, &gl->texture);
+    glDeleteBuffers(1, &gl->ring);
+    glDeleteTextures(1, &gl->ramps);
+
+    free(gl->cmds);
+    free(gl->verts);
+    free(gl->covers);
+    free(gl->fanfirst);
+    free(gl->fancount);
+    free(gl->quads);
+    free(gl->rects);
+    free(gl->instances);
+    free(gl->fringes);
+    free(gl->moved);
+    free(gl->done);
+    free_scratch(&gl->scratch);
+    free(gl->reads);
+    free(gl->spares);
+    free(gl->readrows);
+
+#ifdef USE_EGL
+    if (gl->egl)
+        stop_egl();
+#endif
+}
+
+
+static void
+_commit(Pg *g)
+{
+    GL *gl = GL(g);
+
+    flush(g);
+    glFlush();
+
+    gl->commits++;
+    deliver_reads(gl, false);
+
+    gl->damagemin = gl->drawnmin;
+    gl->damagemax = gl->drawnmax;
+    gl->drawnmin = pgpt(INFINITY, INFINITY);
+    gl->drawnmax = pgpt(-INFINITY, -INFINITY);
+    gl->limited = false;
+}
+
+
+static void
+_clear(Pg *g)
+{
+    const PgPaint *paint = g->s.clear;
+
+    if (paint->nstops == 1)
+        record(g, CMD_CLEAR, paint);
+
+    else {
+        GL  *gl = GL(g);
+        Cmd *cmd = record(g, CMD_TRIANGLES, paint);
+
+        PgPt verts[] = { pgpt(0.0f, 0.0f), pgpt(g->sx, 0.0f), pgpt(0.0f, g->sy),
+                         pgpt(g->sx, 0.0f), pgpt(0.0f, g->sy), pgpt(g->sx, g->sy) };
+
+        cmd->first = append_verts(gl, verts, 6, pgpt(0.0f, 0.0f), cmd);
+        cmd->count = 6;
+    }
+}
+
+
+static bool
+invisible(const PgPaint *paint)
+{
+    return !paint || (paint->nstops == 1 && paint->colors[0].a == 0.0f);
+}
+
+
+typedef struct {
+    PgPt        first;      // First and last edges that have a length.
+    PgPt        last;
+    float       turn;       // Direction of the turns so far.
+    int         dx;         // Horizontal direction of the last edge.
+    int         firstdx;
+    unsigned    flips;      // Number of changes in horizontal direction.
+} Convexity;
+
+
+// Add an edge to the outline and return false if it is not convex.
+static bool
+add_edge(Convexity *c, PgPt e)
+{
+    if (e.x == 0.0f && e.y == 0.0f)
+        return true;
+
+    if (c->last.x == 0.0f && c->last.y == 0.0f)
+        c->first = e;
+    else {
+        float cross = c->last.x * e.y - c->last.y * e.x;
+
+        if (cross * c->turn < 0.0f || (cross == 0.0f && dot(c->last, e) < 0.0f))
+            return false;
+        if (cross != 0.0f)
+            c->turn = cross;
+    }
+    c->last = e;
+
+    int dx = (e.x > 0.0f) - (e.x < 0.0f);
+
+    if (dx && !c->firstdx)
+        c->firstdx = dx;
+    else if (dx && dx != c->dx)
+        c->flips++;
+    if (dx)
+        c->dx = dx;
+
+    return c->flips <= 2;
+}
+
+
+/*
+    Check whether the path is a single convex subpath.
+    Curves are judged by their control points since a curve whose
+    control points make a convex polygon is convex itself. The edges must
+    all turn the same way and go back and forth only once, which rules
+    out outlines that wind around more than once.
+*/
+static bool
+is_convex(const PgPath *path)
+{
+    Convexity   c = { .turn = 0.0f };
+
+    if (!path->nparts || path->parts[0].type != PG_PART_MOVE)
+        return false;
+
+    PgPt        start = path->parts[0].pt[0];
+    PgPt        prev = start;
+
+    for (const PgPart *p = path->parts + 1; p < path->parts + path->nparts; p++) {
+        unsigned n = p->type == PG_PART_CURVE4? 3:
+                     p->type == PG_PART_CURVE3? 2:
+                     p->type == PG_PART_LINE? 1:
+                     0;
+
+        if (p->type == PG_PART_MOVE ||
+            (p->type == PG_PART_CLOSE && p + 1 < path->parts + path->nparts))
+            return false;
+
+        for (unsigned i = 0; i < n; i++) {
+            if (!add_edge(&c, sub(p->pt[i], prev)))
+                return false;
+            prev = p->pt[i];
+        }
+    }
+
+    // Close the outline and turn back onto the first edge.
+    return  add_edge(&c, sub(start, prev)) &&
+            add_edge(&c, c.first) &&
+            c.turn != 0.0f;
+}
+
+
+// Coordinates built up from relative moves may be off by rounding.
+static inline bool
+close_to(float a, float b)
+{
+    return fabsf(a - b) <= 1e-4f * fmaxf(1.0f, fmaxf(fabsf(a), fabsf(b)));
+}
+
+
+/*
+    Check whether the path is exactly a rectangle or a rounded rectangle
+    as made by pg_path_rectangle() and pg_path_rounded_rectangle().
+    Rectangles may go around either way.
+*/
+static bool
+find_rect(const PgPath *path, PgPt *min, PgPt *max, float *radius)
+{
+    static const PgPartType square[] = {
+        PG_PART_MOVE, PG_PART_LINE, PG_PART_LINE, PG_PART_LINE, PG_PART_CLOSE,
+    };
+    static const PgPartType rounded[] = {
+        PG_PART_MOVE,
+        PG_PART_CURVE3, PG_PART_LINE, PG_PART_CURVE3, PG_PART_LINE,
+        PG_PART_CURVE3, PG_PART_LINE, PG_PART_CURVE3,
+        PG_PART_CLOSE,
+    };
+    const PgPartType    *types = path->nparts == 5? square:
+                                 path->nparts == 9? rounded:
+                                 0;
+    PgPt                pts[12];
+    unsigned            npts = 0;
+
+    if (!types)
+        return false;
+
+    for (unsigned i = 0; i < path->nparts; i++) {
+        const PgPart *p = path->parts + i;
+
+        if (p->type != types[i])
+            return false;
+        if (p->type != PG_PART_CLOSE)
+            pts[npts++] = p->pt[0];
+        if (p->type == PG_PART_CURVE3)
+            pts[npts++] = p->pt[1];
+    }
+
+    PgPt    lo = path->parts[0].pt[0];
+    PgPt    hi = lo;
+
+    for (unsigned i = 1; i < npts; i++) {
+        lo = pgpt(fminf(lo.x, pts[i].x), fminf(lo.y, pts[i].y));
+        hi = pgpt(fmaxf(hi.x, pts[i].x), fmaxf(hi.y, pts[i].y));
+    }
+
+    if (types == square) {
+        PgPt    a = pts[0], b = pts[1], c = pts[2], d = pts[3];
+        bool    across = a.y == b.y && b.x == c.x && c.y == d.y && close_to(d.x, a.x);
+        bool    down = a.x == b.x && b.y == c.y && c.x == d.x && close_to(d.y, a.y);
+
+        if (!across && !down)
+            return false;
+        *radius = 0.0f;
+    }
+    else {
+        float   r = hi.x - pts[0].x;
+        PgPt    want[] = {
+            pgpt(hi.x - r, lo.y),
+            pgpt(hi.x, lo.y), pgpt(hi.x, lo.y + r),
+            pgpt(hi.x, hi.y - r),
+            pgpt(hi.x, hi.y), pgpt(hi.x - r, hi.y),
+            pgpt(lo.x + r, hi.y),
+            pgpt(lo.x, hi.y), pgpt(lo.x, hi.y - r),
+            pgpt(lo.x, lo.y + r),
+            pgpt(lo.x, lo.y), pgpt(lo.x + r, lo.y),
+        };
+
+        if (r <= 0.0f)
+            return false;
+        for (unsigned i = 0; i < npts; i++)
+            if (!close_to(pts[i].x, want[i].x) || !close_to(pts[i].y, want[i].y))
+                return false;
+        *radius = r;
+    }
+
+    *min = lo;
+    *max = hi;
+    return true;
+}
+
+
+/*
+    Record the fill of a rectangle as an instance of the unit square if
+    it is still upright once transformed.
+    Runs of rectangles with the same paint become one command.
+*/
+static bool
+fill_rect(Pg *g)
+{
+    GL      *gl = GL(g);
+    PgTM    ctm = g->s.ctm;
+    PgPt    min, max;
+    float   r;
+
+    if (!gl->corners || ctm.b != 0.0f || ctm.c != 0.0f || ctm.a == 0.0f || ctm.d == 0.0f)
+        return false;
+
+    if (!find_rect(g->path, &min, &max, &r))
+        return false;
+
+    PgPt    a = pg_mat_apply(ctm, min);
+    PgPt    b = pg_mat_apply(ctm, max);
+
+    min = pgpt(fminf(a.x, b.x), fminf(a.y, b.y));
+    max = pgpt(fmaxf(a.x, b.x), fmaxf(a.y, b.y));
+
+    gl->rects = reserve(gl->rects, &gl->maxrects, gl->nrects + 1, 6 * sizeof *gl->rects);
+    memcpy(gl->rects + gl->nrects * 6,
+           (GLfloat[]) { min.x, min.y, max.x, max.y, r * fabsf(ctm.a), r * fabsf(ctm.d) },
+           6 * sizeof *gl->rects);
+
+    // The edges are antialiased into the pixels around them.
+    min = sub(min, pgpt(1.0f, 1.0f));
+    max = add(max, pgpt(1.0f, 1.0f));
+
+    Cmd *cmd = record(g, CMD_RECTS, g->s.fill);
+    Cmd *last = gl->ncmds > 1? cmd - 1: 0;
+
+    if (last && same_state(last, cmd) && last->first + last->count == gl->nrects) {
+        gl->ncmds--;
+        last->count++;
+        last->min = pgpt(fminf(last->min.x, min.x), fminf(last->min.y, min.y));
+        last->max = pgpt(fmaxf(last->max.x, max.x), fmaxf(last->max.y, max.y));
+    }
+    else {
+        cmd->first = gl->nrects;
+        cmd->count = 1;
+        cmd->min = min;
+        cmd->max = max;
+    }
+
+    gl->nrects++;
+    return true;
+}
+
+
+// Fan a convex outline into a list of triangles in the scratch space.
+static PgPt*
+fan_convex(GL *gl, const Flat *flat, unsigned *pn)
+{
+    Scratch     *scratch = &gl->scratch;
+    const PgPt  *verts = flat->verts;
+    unsigned    n = flat->nverts;
+    unsigned    ntris = 0;
+
+    if (n > 1 && verts[n - 1].x == verts[0].x && verts[n - 1].y == verts[0].y)
+        n--;
+
+    PgPt        *tris = reserve(scratch->tris, &scratch->maxtris, n < 3? 0: 3 * (n - 2), sizeof *tris);
+
+    scratch->tris = tris;
+    for (unsigned i = 1; i + 1 < n; i++) {
+        tris[ntris++] = verts[0];
+        tris[ntris++] = verts[i];
+        tris[ntris++] = verts[i + 1];
+    }
+
+    *pn = ntris;
+    return tris;
+}
+
+
+/*
+    Add the fringe of an edge: a quad reaching half a pixel around it,
+    with the ends of the edge at each vertex so that the shader can find
+    the distance of each pixel from it.
+*/
+static void
+add_fringe(GL *gl, PgPt a, PgPt b)
+{
+    if (a.x == b.x && a.y == b.y)
+        return;
+
+    PgPt    along = scale_pt(normalize(sub(b, a)), 0.5f);
+    PgPt    across = perp(along);
+    PgPt    start = sub(a, along);
+    PgPt    end = add(b, along);
+    PgPt    quad[] = {
+        sub(start, across), add(start, across), sub(end, across),
+        add(start, across), sub(end, across), add(end, across),
+    };
+
+    gl->fringes = reserve(gl->fringes, &gl->maxfringes, gl->nfringes + 6, 6 * sizeof *gl->fringes);
+
+    for (unsigned i = 0; i < 6; i++)
+        memcpy(gl->fringes + gl->nfringes++ * 6,
+               (GLfloat[]) { quad[i].x, quad[i].y, a.x, a.y, b.x, b.y },
+               6 * sizeof *gl->fringes);
+}
+
+
+/*
+    Add the quad that covers a fill.
+    Antialiased fills reach a pixel further to take in their fringes.
+*/
+static void
+add_cover(GL *gl, Cmd *cmd)
+{
+    if (cmd->nfringe) {
+        cmd->min = sub(cmd->min, pgpt(1.0f, 1.0f));
+        cmd->max = add(cmd->max, pgpt(1.0f, 1.0f));
+    }
+
+    PgPt        min = cmd->min;
+    PgPt        max = cmd->max;
+
+    gl->covers = reserve(gl->covers, &gl->maxcovers, gl->ncovers + 6, sizeof *gl->covers);
+    cmd->cover = gl->ncovers;
+    gl->covers[gl->ncovers++] = pgpt(min.x, min.y);
+    gl->covers[gl->ncovers++] = pgpt(max.x, min.y);
+    gl->covers[gl->ncovers++] = pgpt(min.x, max.y);
+    gl->covers[gl->ncovers++] = pgpt(max.x, min.y);
+    gl->covers[gl->ncovers++] = pgpt(min.x, max.y);
+    gl->covers[gl->ncovers++] = pgpt(max.x, max.y);
+}
+
+
+// Record a fill of flattened subpaths and any curves left to the GPU.
+static void
+fill_flat(Pg *g, const Flat *flat)
+{
+    GL          *gl = GL(g);
+
+    if (!flat->nverts)
+        return;
+
+    if (flat->convex && !flat->ncurves && !gl->analytic) {
+        // Fanned triangles cover each pixel once so the stencil is not needed.
+        unsigned    ntris;
+        PgPt        *tris = fan_convex(gl, flat, &ntris);
+
+        if (!ntris)
+            return;
+
+        Cmd *cmd = record(g, CMD_TRIANGLES, g->s.fill);
+        cmd->first = append_verts(gl, tris, ntris, flat->offset, cmd);
+        cmd->count = ntris;
+        return;
+    }
+
+    const unsigned  *subs = flat->subs;
+    unsigned        nsubs = flat->nsubs;
+    const PgPt      *curves = flat->curves;
+    unsigned        ncurves = flat->ncurves;
+    Cmd             *cmd = record(g, CMD_FILL, g->s.fill);
+    unsigned        base = append_verts(gl, flat->verts, flat->nverts, flat->offset, cmd);
+
+    if (ncurves && flat->patches) {
+        PgPt    min = cmd->min;
+        PgPt    max = cmd->max;
+
+        cmd->patches = append_verts(gl, curves, ncurves, flat->offset, cmd);
+        cmd->npatches = ncurves;
+
+        // Control points can be outside the fans.
+        cmd->min = pgpt(fminf(cmd->min.x, min.x), fminf(cmd->min.y, min.y));
+        cmd->max = pgpt(fmaxf(cmd->max.x, max.x), fmaxf(cmd->max.y, max.y));
+    }
+
+    else if (ncurves) {
+        static const GLfloat uv[] = { 0.0f, 0.0f,   0.5f, 0.0f,   1.0f, 1.0f };
+
+        gl->quads = reserve(gl->quads, &gl->maxquads, gl->nquads + ncurves, 4 * sizeof *gl->quads);
+        cmd->curves = gl->nquads;
+        cmd->ncurves = ncurves;
+
+        for (unsigned i = 0; i < ncurves; i++) {
+            GLfloat *q = gl->quads + (gl->nquads++) * 4;
+            PgPt    p = curves[i];
+
+            q[0] = p.x;
+            q[1] = p.y;
+            q[2] = uv[i % 3 * 2];
+            q[3] = uv[i % 3 * 2 + 1];
+
+            // Control points can be outside the fans.
+            cmd->min = pgpt(fminf(cmd->min.x, p.x), fminf(cmd->min.y, p.y));
+            cmd->max = pgpt(fmaxf(cmd->max.x, p.x), fmaxf(cmd->max.y, p.y));
+        }
+    }
+
+    unsigned    maxfans = gl->maxfans;
+
+    gl->fanfirst = reserve(gl->fanfirst, &maxfans, gl->nfans + nsubs, sizeof *gl->fanfirst);
+    gl->fancount = reserve(gl->fancount, &gl->maxfans, gl->nfans + nsubs, sizeof *gl->fancount);
+    cmd->first = gl->nfans;
+    cmd->count = nsubs;
+
+    for (unsigned i = 0; i < nsubs; i++) {
+        gl->fanfirst[gl->nfans] = (GLint) (base + SUB(subs[i]));
+        gl->fancount[gl->nfans++] = (GLsizei) (SUB(subs[i + 1]) - SUB(subs[i]));
+    }
+
+    // Every subpath is closed back to its start.
+    if (gl->analytic) {
+        const PgPt  *verts = gl->verts + base;
+
+        cmd->fringe = gl->nfringes;
+        for (unsigned i = 0; i < nsubs; i++) {
+            unsigned start = SUB(subs[i]);
+            unsigned end = SUB(subs[i + 1]);
+
+            for (unsigned j = start; j < end; j++)
+                add_fringe(gl, verts[j], verts[j + 1 < end? j + 1: start]);
+        }
+        cmd->nfringe = gl->nfringes - cmd->fringe;
+    }
+
+    add_cover(gl, cmd);
+}
+
+
+// The ends of segments that join are the same but for rounding.
+static inline bool
+joins(PgPt a, PgPt b, PgPt c, PgPt d)
+{
+    return  close_to(a.x, c.x) && close_to(a.y, c.y) &&
+            close_to(b.x, d.x) && close_to(b.y, d.y);
+}
+
+
+/*
+    Record a stroke antialiased with fringes.
+    Its triangles come in pairs of `a b c` and `b c d` for each segment,
+    outlined by `ac` and `bd`. Segments that join share `ab` with the
+    `cd` of the previous one. Elsewhere they are the ends.
+*/
+static void
+stroke_fringed(Pg *g, const PgPt *tris, unsigned ntris, PgPt offset)
+{
+    GL          *gl = GL(g);
+    Cmd         *cmd = record(g, CMD_FILL, g->s.stroke);
+
+    cmd->stroke = true;
+    cmd->first = append_verts(gl, tris, ntris, offset, cmd);
+    cmd->count = ntris;
+    cmd->fringe = gl->nfringes;
+
+    const PgPt  *t = gl->verts + cmd->first;
+
+    for (unsigned i = 0; i + 6 <= ntris; i += 6) {
+        const PgPt  *prev = i? t + i - 6: 0;
+        const PgPt  *next = i + 12 <= ntris? t + i + 6: 0;
+
+        add_fringe(gl, t[i], t[i + 2]);
+        add_fringe(gl, t[i + 1], t[i + 5]);
+
+        if (!prev || !joins(prev[2], prev[5], t[i], t[i + 1]))
+            add_fringe(gl, t[i], t[i + 1]);
+        if (!next || !joins(t[i + 2], t[i + 5], next[0], next[1]))
+            add_fringe(gl, t[i + 2], t[i + 5]);
+    }
+
+    cmd->nfringe = gl->nfringes - cmd->fringe;
+    add_cover(gl, cmd);
+}
+
+
+static void
+stroke_flat(Pg *g, const Flat *flat)
+{
+    GL          *gl = GL(g);
+    PgPt        *final;
+    unsigned    nfinal;
+
+    final = stroke_triangles(g, &gl->scratch, flat->verts, flat->nverts, flat->subs, flat->nsubs, &nfinal);
+
+    if (nfinal && gl->analytic)
+        stroke_fringed(g, final, nfinal, flat->offset);
+
+    else if (nfinal) {
+        Cmd *cmd = record(g, CMD_TRIANGLES, g->s.stroke);
+        cmd->first = append_verts(gl, final, nfinal, flat->offset, cmd);
+        cmd->count = nfinal;
+    }
+}
+
+
+/*
+    Split the path into on-curve points and curves in device space.
+    Curves are cubic patches for the geometry shader or quadratics for
+    drawing implicitly. For the latter, cubics are split into as many
+    quadratics as it takes to keep within the tolerance, judged by the
+    size of their third difference.
+*/
+static void
+split_curves(Pg *g, bool patches, Flat *flat)
+{
+    Scratch     *scratch = &GL(g)->scratch;
+    PgPt        *verts = scratch->verts;
+    unsigned    *subs = scratch->subs;
+    PgPt        *curves = scratch->tris;
+    unsigned    nverts = 0;
+    unsigned    nsubs = 0;
+    unsigned    ncurves = 0;
+    PgTM        ctm = g->s.ctm;
+    PgPt        home = pg_mat_apply(ctm, pgpt(0.0f, 0.0f));
+    PgPt        cur = home;
+    PgPath      path = *g->path;
+    float       tolerance = tolerance_of(g->s.flatness);
+
+    for (unsigned i = 0; i < path.nparts; i++) {
+        verts = reserve(verts, &scratch->maxverts, nverts + MAX_QUADS, sizeof *verts);
+        subs = reserve(subs, &scratch->maxsubs, nsubs + 2, sizeof *subs);
+        curves = reserve(curves, &scratch->maxtris, ncurves + 3 * MAX_QUADS, sizeof *curves);
+
+        PgPt    *pts = path.parts[i].pt;
+        switch (path.parts[i].type) {
+        case PG_PART_MOVE:
+            cur = home = verts[nverts++] = pg_mat_apply(ctm, pts[0]);
+            subs[nsubs++] = nverts - 1;
+            break;
+        case PG_PART_LINE:
+            cur = verts[nverts++] = pg_mat_apply(ctm, pts[0]);
+            break;
+        case PG_PART_CURVE3:
+            if (patches) {
+                // Raise to a cubic.
+                PgPt b = pg_mat_apply(ctm, pts[0]);
+                PgPt c = pg_mat_apply(ctm, pts[1]);
+
+                curves[ncurves++] = cur;
+                curves[ncurves++] = add(cur, scale_pt(sub(b, cur), 2.0f / 3.0f));
+                curves[ncurves++] = add(c, scale_pt(sub(b, c), 2.0f / 3.0f));
+                curves[ncurves++] = cur = verts[nverts++] = c;
+                break;
+            }
+            curves[ncurves++] = cur;
+            curves[ncurves++] = pg_mat_apply(ctm, pts[0]);
+            curves[ncurves++] = cur = verts[nverts++] = pg_mat_apply(ctm, pts[1]);
+            break;
+        case PG_PART_CURVE4:
+            if (patches) {
+                curves[ncurves++] = cur;
+                curves[ncurves++] = pg_mat_apply(ctm, pts[0]);
+                curves[ncurves++] = pg_mat_apply(ctm, pts[1]);
+                curves[ncurves++] = cur = verts[nverts++] = pg_mat_apply(ctm, pts[2]);
+                break;
+            }
+            else {
+                PgPt    a = cur;
+                PgPt    b = pg_mat_apply(ctm, pts[0]);
+                PgPt    c = pg_mat_apply(ctm, pts[1]);
+                PgPt    d = pg_mat_apply(ctm, pts[2]);
+                PgPt    dd = add(sub(d, a), scale_pt(sub(b, c), 3.0f));
+                float   error = sqrtf(dot(dd, dd)) * (sqrtf(3.0f) / 36.0f);
+                unsigned n = (unsigned) fminf(fmaxf(ceilf(cbrtf(error / tolerance)), 1.0f), MAX_QUADS);
+
+                // Coefficients of the polynomial.
+                PgPt    k1 = scale_pt(sub(b, a), 3.0f);
+                PgPt    k2 = sub(scale_pt(sub(c, b), 3.0f), k1);
+                PgPt    k3 = dd;
+                float   h = 1.0f / n;
+                PgPt    p0 = a;
+                PgPt    v0 = k1;
+
+                for (unsigned j = 1; j <= n; j++) {
+                    float   t = j * h;
+                    PgPt    p1 = j == n? d: add(a, add(scale_pt(k1, t),
+                                                       add(scale_pt(k2, t * t),
+                                                           scale_pt(k3, t * t * t))));
+                    PgPt    v1 = add(k1, add(scale_pt(k2, 2.0f * t),
+                                             scale_pt(k3, 3.0f * t * t)));
+
+                    // The quadratic through the ends of the piece with
+                    // its control point between those of the cubic.
+                    PgPt    q1 = add(p0, scale_pt(v0, h / 3.0f));
+                    PgPt    q2 = sub(p1, scale_pt(v1, h / 3.0f));
+                    PgPt    ctrl = scale_pt(sub(scale_pt(add(q1, q2), 3.0f), add(p0, p1)), 0.25f);
+
+                    curves[ncurves++] = p0;
+                    curves[ncurves++] = ctrl;
+                    curves[ncurves++] = verts[nverts++] = p1;
+                    p0 = p1;
+                    v0 = v1;
+                }
+                cur = d;
+            }
+            break;
+        case PG_PART_CLOSE:
+            verts[nverts++] = cur = home;
+            if (nsubs)
+                subs[nsubs - 1] |= CLOSED;
+            break;
+        }
+    }
+    subs = reserve(subs, &scratch->maxsubs, nsubs + 1, sizeof *subs);
+    subs[nsubs] = nverts;
+
+    scratch->verts = verts;
+    scratch->subs = subs;
+    scratch->tris = curves;
+
+    *flat = (Flat) {
+        .verts = verts,
+        .nverts = nverts,
+        .subs = subs,
+        .nsubs = nsubs,
+        .curves = curves,
+        .ncurves = ncurves,
+        .patches = patches,
+    };
+}
+
+
+static void
+_fill(Pg *g)
+{
+    GL      *gl = GL(g);
+    Flat    flat;
+
+    if (invisible(g->s.fill))
+        /* Skip everything if colour is transparent. */
+        return;
+
+    if (fill_rect(g))
+        return;
+
+    // Convex shapes are drawn straight from flattened vertices.
+    // Fringes need every edge flattened.
+    bool    convex = is_convex(g->path);
+
+    if (!convex && !gl->analytic && (gl->implicit || gl->patchprog))
+        split_curves(g, !gl->implicit, &flat);
+    else
+        get_flat(g, &flat);
+
+    flat.convex = convex;
+    fill_flat(g, &flat);
+}
+
+
+static void
+_stroke(Pg *g)
+{
+    Flat    flat;
+
+    get_flat(g, &flat);
+    stroke_flat(g, &flat);
+}
+
+
+/*
+    The path is flattened once for both unless curves are implicit.
+    The stroke needs it flattened on the CPU anyway, so the fill uses
+    that rather than the geometry shader.
+*/
+static void
+_fill_stroke(Pg *g)
+{
+    Flat    flat;
+
+    if (GL(g)->implicit && !GL(g)->analytic) {
+        _fill(g);
+        _stroke(g);
+        return;
+    }
+
+    get_flat(g, &flat);
+    flat.convex = is_convex(g->path);
+
+    if (!invisible(g->s.fill) && !fill_rect(g))
+        fill_flat(g, &flat);
+    stroke_flat(g, &flat);
+}
+
+
+// The transform that takes what `from` draws to where `to` draws it.
+static PgTM
+relative(PgTM from, PgTM to)
+{
+    if (from.a == to.a && from.b == to.b && from.c == to.c && from.d == to.d)
+        return (PgTM) { 1.0f, 0.0f, 0.0f, 1.0f, to.e - from.e, to.f - from.f };
+
+    float   det = from.a * from.d - from.b * from.c;
+    PgTM    inverse = {
+        from.d / det, -from.b / det,
+        -from.c / det, from.a / det,
+        (from.c * from.f - from.d * from.e) / det,
+        (from.b * from.e - from.a * from.f) / det,
+    };
+
+    return pg_mat_multiply(inverse, to);
+}
+
+
+/*
+    Fill copies of a path while flattening it only once, as drawn by the
+    first transform. Every copy is moved from there.
+    Convex paths in solid colours are drawn as instances of one list of
+    triangles, with the colours converted here. Otherwise each copy is
+    recorded as a fill of the same vertices.
+*/
+static bool
+_fill_instances(Pg *g, const PgPath *path, const PgTM *xforms, const PgPaint **paints, unsigned n)
+{
+    GL              *gl = GL(g);
+    PgPath          *old_path = g->path;
+    PgTM            ctm = g->s.ctm;
+    const PgPaint   *fill = g->s.fill;
+    const PgPaint   *lead = 0;
+    bool            convex = is_convex(path);
+    bool            instanced = gl->corners && convex && !gl->analytic;
+    Flat            flat;
+
+    if (!n)
+        return true;
+
+    PgTM            first = pg_mat_multiply(ctm, xforms[0]);
+
+    if (first.a * first.d - first.b * first.c == 0.0f)
+        return false;
+
+    for (unsigned i = 0; instanced && i < n; i++) {
+        const PgPaint *paint = paints && paints[i]? paints[i]: fill;
+
+        lead = lead? lead: paint;
+        instanced = !paint || paint->nstops == 1;
+    }
+
+    // The path is only read.
+    g->path = (PgPath*) path;
+    g->s.ctm = first;
+    get_flat(g, &flat);
+    g->path = old_path;
+    g->s.ctm = ctm;
+
+    if (!flat.nverts)
+        return true;
+
+    if (instanced && lead) {
+        unsigned    ntris;
+        PgPt        *tris = fan_convex(gl, &flat, &ntris);
+
+        if (!ntris)
+            return true;
+
+        Cmd     *cmd = record(g, CMD_INSTANCES, lead);
+        PgPt    corners[4];
+
+        cmd->first = append_verts(gl, tris, ntris, flat.offset, cmd);
+        cmd->count = ntris;
+        cmd->instances = gl->ninstances;
+        corners[0] = cmd->min;
+        corners[1] = pgpt(cmd->max.x, cmd->min.y);
+        corners[2] = pgpt(cmd->min.x, cmd->max.y);
+        corners[3] = cmd->max;
+        cmd->min = pgpt(INFINITY, INFINITY);
+        cmd->max = pgpt(-INFINITY, -INFINITY);
+
+        gl->instances = reserve(gl->instances, &gl->maxinstances, gl->ninstances + n, 10 * sizeof *gl->instances);
+
+        for (unsigned i = 0; i < n; i++) {
+            const PgPaint   *paint = paints && paints[i]? paints[i]: fill;
+
+            if (invisible(paint))
+                continue;
+
+            PgTM            m = relative(first, pg_mat_multiply(ctm, xforms[i]));
+            PgColor         c = convert(paint->cspace, paint->colors[0], g->s.gamma);
+
+            memcpy(gl->instances + gl->ninstances++ * 10,
+                   (GLfloat[]) { m.a, m.c, m.e, m.b, m.d, m.f, c.u, c.v, c.w, c.a },
+                   10 * sizeof *gl->instances);
+            cmd->ninstances++;
+
+            for (unsigned j = 0; j < 4; j++) {
+                PgPt p = pg_mat_apply(m, corners[j]);
+                cmd->min = pgpt(fminf(cmd->min.x, p.x), fminf(cmd->min.y, p.y));
+                cmd->max = pgpt(fmaxf(cmd->max.x, p.x), fmaxf(cmd->max.y, p.y));
+            }
+        }
+
+        if (!cmd->ninstances)
+            gl->ncmds--;
+        return true;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        PgTM    m = relative(first, pg_mat_multiply(ctm, xforms[i]));
+        Flat    copy = flat;
+
+        g->s.fill = paints && paints[i]? paints[i]: fill;
+
+        if (invisible(g->s.fill))
+            continue;
+
+        if (m.a == 1.0f && m.b == 0.0f && m.c == 0.0f && m.d == 1.0f)
+            copy.offset = add(flat.offset, pgpt(m.e, m.f));
+
+        else {
+            gl->moved = reserve(gl->moved, &gl->maxmoved, flat.nverts, sizeof *gl->moved);
+            for (unsigned j = 0; j < flat.nverts; j++)
+                gl->moved[j] = pg_mat_apply(m, add(flat.verts[j], flat.offset));
+            copy.verts = gl->moved;
+            copy.offset = pgpt(0.0f, 0.0f);
+        }
+
+        copy.convex = convex;
+        fill_flat(g, &copy);
+    }
+
+    g->s.fill = fill;
+    return true;
+}
+
+
+static bool
+same_key(const GlyphKey *a, const GlyphKey *b)
+{
+    return  a->font == b->font &&
+            a->glyph == b->glyph &&
+            a->scale.x == b->scale.x &&
+            a->scale.y == b->scale.y &&
+            a->subpixel == b->subpixel;
+}
 
-            nfinal = miter(w,
-                            verts[end - 2], verts[end - 1],
-                            verts[start], verts[start + 1],
-                            final, nfinal);
-        }
 
-        else if (end - start <= 2) {
+static unsigned
+hash_key(const GlyphKey *key)
+{
+    uint32_t    words[5];
 
-            // There is only one segment.
+    words[0] = key->font;
+    words[1] = key->glyph;
+    memcpy(&words[2], &key->scale.x, sizeof words[2]);
+    memcpy(&words[3], &key->scale.y, sizeof words[3]);
+    words[4] = key->subpixel;
 
-            if (end - start == 2) {
-                PgPt nv = normalize(sub(verts[1], verts[0]));
-                PgPt wv = mul(perp(nv), w);
-                PgPt cv = mul(nv, cap);
-                PgPt a = sub(sub(verts[0], wv), cv);
-                PgPt b = sub(add(verts[0], wv), cv);
-                PgPt c = add(sub(verts[1], wv), cv);
-                PgPt d = add(add(verts[1], wv), cv);
-                final[nfinal++] = a, final[nfinal++] = b, final[nfinal++] = c;
-                final[nfinal++] = b, final[nfinal++] = c, final[nfinal++] = d;
-            }
-        }
+    return hash_bytes(2166136261u, words, sizeof words);
+}
 
-        else {
 
-            // There are multiple segments.
+// A cached glyph is valid until its shelf is evicted.
+static bool
+live_glyph(const GL *gl, const Glyph *glyph)
+{
+    if (!glyph->gen)
+        return false;
+
+    if (!glyph->sx)
+        return true;
+
+    return  glyph->shelf < gl->nshelves &&
+            gl->shelves[glyph->shelf].gen == glyph->gen;
+}
+
+
+// Return the slot holding `key` or the empty slot where it belongs.
+static Glyph*
+lookup_glyph(GL *gl, const GlyphKey *key)
+{
+    unsigned mask = gl->maxglyphs - 1;
+
+    for (unsigned i = hash_key(key) & mask; ; i = (i + 1) & mask) {
+        Glyph *slot = gl->glyphs + i;
+
+        if (!slot->gen || same_key(&slot->key, key))
+            return slot;
+    }
+}
+
+
+/*
+    Make room for another glyph in the hash table.
+    Glyphs on evicted shelves are dropped when the table is rebuilt.
+*/
+static void
+grow_glyphs(GL *gl)
+{
+    if (4 * (gl->nglyphs + 1) <= 3 * gl->maxglyphs)
+        return;
+
+    Glyph       *old = gl->glyphs;
+    unsigned    nold = gl->maxglyphs;
+    unsigned    nlive = 0;
+
+    for (unsigned i = 0; i < nold; i++)
+        nlive += live_glyph(gl, old + i);
+
+    unsigned    max = 256;
+    while (max < 4 * (nlive + 1))
+        max *= 2;
+
+    gl->glyphs = calloc(max, sizeof *gl->glyphs);
+    gl->maxglyphs = max;
+    gl->nglyphs = nlive;
+
+    for (unsigned i = 0; i < nold; i++)
+        if (live_glyph(gl, old + i))
+            *lookup_glyph(gl, &old[i].key) = old[i];
+
+    free(old);
+}
+
+
+static Shelf*
+add_shelf(GL *gl, int height)
+{
+    int top = gl->nshelves?
+                gl->shelves[gl->nshelves - 1].y + gl->shelves[gl->nshelves - 1].height:
+                0;
+
+    if (top + height > gl->atlassize)
+        return 0;
+
+    gl->shelves = reserve(gl->shelves, &gl->maxshelves, gl->nshelves + 1, sizeof *gl->shelves);
+
+    Shelf *shelf = gl->shelves + gl->nshelves++;
+    *shelf = (Shelf) { .y = top, .height = height, .gen = ++gl->gen };
+    return shelf;
+}
 
-            nfinal = startcap(w, cap,
-                                verts[start], verts[start + 1],
-                                verts[start + 2], final, nfinal);
 
-            for (unsigned i = start + 1; i + 2 < end; i++)
-                nfinal = miter(w,
-                                verts[i - 1], verts[i],
-                                verts[i + 1], verts[i + 2],
-                                final, nfinal);
+/*
+    Find space in the atlas for a glyph.
+    Shelf heights are rounded up so that glyphs of about the same size
+    share them. When the atlas is full, the least recently used shelf of
+    a suitable height is emptied. A shelf still needed by commands that
+    have not been drawn yet is only emptied after flushing them.
+    If no shelf is suitable, the whole atlas is emptied.
+*/
+static Shelf*
+place_glyph(Pg *g, int sx, int sy)
+{
+    GL      *gl = GL(g);
+    int     height = (sy + 7) & ~7;
+    Shelf   *lru = 0;
+
+    for (Shelf *s = gl->shelves; s < gl->shelves + gl->nshelves; s++)
+        if (s->height == height && s->x + sx <= gl->atlassize)
+            return s;
+
+    Shelf *shelf = add_shelf(gl, height);
+    if (shelf)
+        return shelf;
+
+    for (Shelf *s = gl->shelves; s < gl->shelves + gl->nshelves; s++)
+        if (s->height >= height && s->height <= 2 * height)
+            if (!lru || s->used < lru->used)
+                lru = s;
+
+    if (lru) {
+        if (lru->used == gl->epoch)
+            flush(g);
+        lru->x = 0;
+        lru->gen = ++gl->gen;
+        return lru;
+    }
+
+    flush(g);
+    gl->nshelves = 0;
+    return add_shelf(gl, height);
+}
+
 
-            nfinal = endcap(w, cap,
-                            verts[end - 3], verts[end - 2],
-                            verts[end - 1], final, nfinal);
+/*
+    Rasterise a glyph into the atlas.
+    The outline is filled on a small image canvas and its coverage is
+    copied into the texture. Returns false if it is too large.
+*/
+static bool
+rasterise_glyph(Pg *g, PgFont *font, float scale, Glyph *out)
+{
+    GL          *gl = GL(g);
+    Pg          *r = gl->raster;
+    float       offset = out->key.subpixel / (float) SUBPIXELS;
+    PgPt        min = pgpt(INFINITY, INFINITY);
+    PgPt        max = pgpt(-INFINITY, -INFINITY);
+
+    pg_canvas_path_clear(r);
+    pg_canvas_identity(r);
+    font->v->glyph_path(r, font, 0.0f, 0.0f, out->key.glyph);
+
+    for (const PgPart *p = r->path->parts; p < r->path->parts + r->path->nparts; p++) {
+        unsigned n = p->type == PG_PART_CURVE4? 3:
+                     p->type == PG_PART_CURVE3? 2:
+                     p->type == PG_PART_CLOSE? 0:
+                     1;
+
+        for (unsigned i = 0; i < n; i++) {
+            min.x = fminf(min.x, p->pt[i].x);
+            min.y = fminf(min.y, p->pt[i].y);
+            max.x = fmaxf(max.x, p->pt[i].x);
+            max.y = fmaxf(max.y, p->pt[i].y);
         }
     }
 
-    set_coords(g);
-    set_paint(g, g->s.stroke);
+    if (min.x > max.x) {
+        // Nothing to draw, but remember that.
+        out->sx = out->sy = 0;
+        return true;
+    }
 
-    GLuint  src = make_buffer(GL_ARRAY_BUFFER, final, nfinal * sizeof *final);
-    glVertexAttribPointer(gl->posloc, 2, GL_FLOAT, 0, 0, 0);
-    glEnableVertexAttribArray(gl->posloc);
+    int left = (int) floorf(min.x * scale + offset) - GLYPH_PAD;
+    int top = (int) floorf(min.y * scale) - GLYPH_PAD;
+    int sx = (int) ceilf(max.x * scale + offset) + GLYPH_PAD - left;
+    int sy = (int) ceilf(max.y * scale) + GLYPH_PAD - top;
+
+    if (sx > GLYPH_MAX || sy > GLYPH_MAX) {
+        pg_canvas_path_clear(r);
+        return false;
+    }
+
+    uint8_t     *pixels = pg_canvas_get_image_pixels(r);
+    uint8_t     coverage[GLYPH_MAX * GLYPH_MAX];
+
+    memset(pixels, 0, (size_t) GLYPH_MAX * (size_t) sy * 4);
+    pg_canvas_set_mat(r, (PgTM) { scale, 0.0f, 0.0f, scale, offset - left, (float) -top });
+    pg_canvas_fill(r);
+
+    for (int y = 0; y < sy; y++)
+        for (int x = 0; x < sx; x++)
+            coverage[y * sx + x] = pixels[(y * GLYPH_MAX + x) * 4 + 3];
+
+    Shelf *shelf = place_glyph(g, sx, sy);
+
+    out->gen = shelf->gen;
+    out->shelf = (unsigned) (shelf - gl->shelves);
+    out->u = shelf->x;
+    out->v = shelf->y;
+    out->left = left;
+    out->top = top;
+    out->sx = sx;
+    out->sy = sy;
+    shelf->x += sx;
+
+    glBindTexture(GL_TEXTURE_2D, gl->atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, out->u, out->v, sx, sy,
+                    GL_ALPHA, GL_UNSIGNED_BYTE, coverage);
+    return true;
+}
 
-    glDisable(GL_STENCIL_TEST);
-    glDrawArrays(GL_TRIANGLES, 0, (GLsizei) nfinal);
 
-    glDisableVertexAttribArray(gl->posloc);
-    glDeleteVertexArrays(1, &src);
+/*
+    Find a glyph in the atlas, rasterising it if it is not there.
+    Each glyph is rasterised once for each font, size, and horizontal
+    subpixel position.
+*/
+static const Glyph*
+find_glyph(Pg *g, PgFont *font, const GlyphKey *key, float scale)
+{
+    GL *gl = GL(g);
 
-    free(verts);
-    free(subs);
-    free(final);
+    if (!gl->atlas) {
+        int size = gl->atlassize;
+
+        glGenTextures(1, &gl->atlas);
+        glBindTexture(GL_TEXTURE_2D, gl->atlas);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, size, size, 0,
+                     GL_ALPHA, GL_UNSIGNED_BYTE, 0);
+
+        gl->raster = pg_canvas_new_image(GLYPH_MAX, GLYPH_MAX, 0);
+    }
+
+    grow_glyphs(gl);
+
+    Glyph *slot = lookup_glyph(gl, key);
+
+    if (live_glyph(gl, slot)) {
+        if (slot->sx)
+            gl->shelves[slot->shelf].used = gl->epoch;
+        return slot;
+    }
+
+    Glyph glyph = { .key = *key, .gen = 1 };
+
+    if (!rasterise_glyph(g, font, scale, &glyph))
+        return 0;
+
+    if (!slot->gen)
+        gl->nglyphs++;
+    *slot = glyph;
+
+    if (slot->sx)
+        gl->shelves[slot->shelf].used = gl->epoch;
+    return slot;
+}
+
+
+/*
+    Draw a glyph from the atlas if it is drawn upright and small enough.
+    A glyph that will not fit in the atlas is filled as an outline on the
+    same baseline, in turn with the rest of the run.
+*/
+static bool
+_show_glyph(Pg *g, PgFont *font, float x, float y, unsigned glyph)
+{
+    GL          *gl = GL(g);
+    PgTM        ctm = g->s.ctm;
+    PgPt        scale = pg_font_get_scale(font);
+
+    if (!gl->atlassize || g->s.underline || !font->v->glyph_path)
+        return false;
+
+    if (ctm.b != 0.0f || ctm.c != 0.0f || ctm.a != ctm.d || ctm.a <= 0.0f)
+        return false;
+
+    if (font->units * scale.y * ctm.a > GLYPH_MAX)
+        return false;
+
+    if (g->s.fill->nstops == 1 && g->s.fill->colors[0].a == 0.0f)
+        return true;
+
+    // Glyphs are positioned to the nearest pixel vertically.
+    PgPt        pen = pg_mat_apply(ctm, pgpt(x, y));
+    float       px = floorf(pen.x);
+    float       py = floorf(pen.y + 0.5f);
+    unsigned    subpixel = (unsigned) ((pen.x - px) * SUBPIXELS + 0.5f);
+
+    if (subpixel == SUBPIXELS) {
+        px += 1.0f;
+        subpixel = 0;
+    }
+
+    GlyphKey key = {
+        .font = font->serial,
+        .glyph = glyph,
+        .scale = pgpt(scale.x * ctm.a, scale.y * ctm.a),
+        .subpixel = subpixel,
+    };
+
+    const Glyph *cached = find_glyph(g, font, &key, ctm.a);
+
+    if (!cached) {
+        PgPath *path = g->path;
+
+        g->path = pg_path_new();
+        pg_canvas_trace_glyph(g, font, x, y + (py - pen.y) / ctm.d, glyph);
+        pg_canvas_fill(g);
+        pg_path_free(g->path);
+        g->path = path;
+        return true;
+    }
+
+    if (!cached->sx)
+        return true;
+
+    float   x0 = px + cached->left;
+    float   y0 = py + cached->top;
+    float   x1 = x0 + cached->sx;
+    float   y1 = y0 + cached->sy;
+    float   u0 = cached->u / (float) gl->atlassize;
+    float   v0 = cached->v / (float) gl->atlassize;
+    float   u1 = (cached->u + cached->sx) / (float) gl->atlassize;
+    float   v1 = (cached->v + cached->sy) / (float) gl->atlassize;
+
+    gl->quads = reserve(gl->quads, &gl->maxquads, gl->nquads + 6, 4 * sizeof *gl->quads);
+
+    GLfloat *q = gl->quads + gl->nquads * 4;
+    memcpy(q, (GLfloat[]) { x0, y0, u0, v0,   x1, y0, u1, v0,   x0, y1, u0, v1,
+                            x1, y0, u1, v0,   x0, y1, u0, v1,   x1, y1, u1, v1 },
+           24 * sizeof *q);
+
+    // Runs of text with the same paint become one command.
+    Cmd *cmd = record(g, CMD_GLYPHS, g->s.fill);
+    Cmd *last = gl->ncmds > 1? cmd - 1: 0;
+
+    if (last && same_state(last, cmd) && last->first + last->count == gl->nquads) {
+        gl->ncmds--;
+        last->count += 6;
+        last->min = pgpt(fminf(last->min.x, x0), fminf(last->min.y, y0));
+        last->max = pgpt(fmaxf(last->max.x, x1), fmaxf(last->max.y, y1));
+    }
+    else {
+        cmd->first = gl->nquads;
+        cmd->count = 6;
+        cmd->min = pgpt(x0, y0);
+        cmd->max = pgpt(x1, y1);
+    }
+
+    gl->nquads += 6;
+    return true;
+}
+
+
+/*
+    Make a framebuffer that draws into `texture`, or into a renderbuffer
+    of its own if there is none, with a stencil to go with it.
+*/
+static bool
+new_target(GLuint texture, GLsizei width, GLsizei height,
+           GLuint *fbo, GLuint *color, GLuint *stencil)
+{
+    GLint   oldfbo = 0;
+
+    *color = 0;
+
+    if (texture) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
+    else {
+        glGenRenderbuffers(1, color);
+        glBindRenderbuffer(GL_RENDERBUFFER, *color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    }
+
+    glGenRenderbuffers(1, stencil);
+    glBindRenderbuffer(GL_RENDERBUFFER, *stencil);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldfbo);
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+
+    if (texture)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, texture, 0);
+    else
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, *color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                              GL_RENDERBUFFER, *stencil);
+
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, (GLuint) oldfbo);
+
+    if (!complete) {
+        glDeleteFramebuffers(1, fbo);
+        glDeleteRenderbuffers(1, stencil);
+        glDeleteRenderbuffers(1, color);
+        return false;
+    }
+    return true;
 }
 
 
+/*
+    Give the buffers of a layer or offscreen canvas a new size and clear
+    them. A layer's parent must have drawn the old contents already.
+*/
 static void
-_fill_stroke(Pg *g)
+size_target(GL *gl, GLsizei width, GLsizei height)
 {
-    _fill(g);
-    _stroke(g);
+    GLint   oldfbo = 0;
+
+    if (gl->texture) {
+        glBindTexture(GL_TEXTURE_2D, gl->texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
+    else {
+        glBindRenderbuffer(GL_RENDERBUFFER, gl->color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, gl->stencil);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldfbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gl->fbo);
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClearStencil(0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    glBindFramebuffer(GL_FRAMEBUFFER, (GLuint) oldfbo);
 }
 
 
 static PgPt
 _set_size(Pg *g, float width, float height)
 {
-    (void) g;
-    glViewport(0.0f, 0.0f, (GLsizei) width, (GLsizei) height);
+    GL *gl = GL(g);
+
+    // Recorded commands are in terms of the old size,
+    // and so is the redraw region.
+    flush(g);
+    gl->limited = false;
+
+    // Framebuffers set the viewport when they are drawn.
+    if (gl->fbo)
+        size_target(gl, (GLsizei) width, (GLsizei) height);
+    else
+        glViewport(0.0f, 0.0f, (GLsizei) width, (GLsizei) height);
     return pgpt(width, height);
 }
 
@@ -691,19 +3566,487 @@ pg_canvas_new_opengl(unsigned width, unsigned height)
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    GLuint  vsh = make_shader(GL_VERTEX_SHADER, VERTEX_SHADER);
-    GLuint  fsh = make_shader(GL_FRAGMENT_SHADER, FRAGMENT_SHADER);
-    GLuint  prog = make_program(vsh, fsh);
+    // Shaders are only compiled if a program is not in the binary cache.
+    uint32_t driver = driver_hash();
+    GLuint  vsh = 0;
+    Program solid = make_variant(driver, &vsh, "#define SOLID");
+    Program linear = make_variant(driver, &vsh, "#define LINEAR");
+    GLuint  prog = solid.prog;
+    GLuint  curvefsh = 0;
+    GLuint  curveprog = build_program(driver, &vsh, VERTEX_SHADER, 0, 0,
+                                      &curvefsh, CURVE_SHADER, 0);
+    GLuint  layerfsh = 0;
+    GLuint  layerprog = build_program(driver, &vsh, VERTEX_SHADER, 0, 0,
+                                      &layerfsh, LAYER_SHADER, 0);
+    GLuint  patchvsh = 0;
+    GLuint  patchgsh = 0;
+    GLuint  patchfsh = 0;
+    GLuint  patchprog = 0;
+    GLint   patchctmloc = -1;
+    GLint   patchsizeloc = -1;
+    GLint   patchtolloc = -1;
+
+    if (GLEW_VERSION_3_2) {
+        patchprog = build_program(driver,
+                                  &patchvsh, PATCH_VERTEX_SHADER,
+                                  &patchgsh, PATCH_GEOMETRY_SHADER,
+                                  &patchfsh, PATCH_FRAGMENT_SHADER,
+                                  0);
+        patchctmloc = glGetUniformLocation(patchprog, "ctm");
+        patchsizeloc = glGetUniformLocation(patchprog, "size");
+        patchtolloc = glGetUniformLocation(patchprog, "tolerance");
+    }
     GLint   posloc = glGetAttribLocation(prog, "pos");
-    GLint   ctmloc = glGetUniformLocation(prog, "ctm");
+    GLint   uvloc = glGetAttribLocation(prog, "uv");
+    GLint   rectloc = glGetAttribLocation(prog, "rect");
+    GLint   radiusloc = glGetAttribLocation(prog, "radius");
+    GLint   xformxloc = glGetAttribLocation(prog, "xform_x");
+    GLint   xformyloc = glGetAttribLocation(prog, "xform_y");
+    GLint   colorloc = glGetAttribLocation(prog, "color");
+    GLuint  ring;
+    GLuint  corners = 0;
+
+    glUseProgram(layerprog);
+    glUniform1i(glGetUniformLocation(layerprog, "layer"), 2);
+
+    glGenBuffers(1, &ring);
+
+    if (GLEW_VERSION_3_3) {
+        static const GLfloat square[] = { 0, 0,  1, 0,  0, 1,  1, 0,  0, 1,  1, 1 };
+
+        glGenBuffers(1, &corners);
+        glBindBuffer(GL_ARRAY_BUFFER, corners);
+        glBufferData(GL_ARRAY_BUFFER, sizeof square, square, GL_STATIC_DRAW);
+    }
 
     return pgnew(GL,
                  _pg_canvas_init(&methods, width, height),
-                 prog,
-                 vsh,
-                 fsh,
-                 posloc,
-                 ctmloc);
+                 .vsh = vsh,
+                 .progs = { solid, linear },
+                 .curveprog = curveprog,
+                 .curvefsh = curvefsh,
+                 .curvectmloc = glGetUniformLocation(curveprog, "ctm"),
+                 .layerprog = layerprog,
+                 .layerfsh = layerfsh,
+                 .layerctmloc = glGetUniformLocation(layerprog, "ctm"),
+                 .opacityloc = glGetUniformLocation(layerprog, "opacity"),
+                 .patchprog = patchprog,
+                 .patchvsh = patchvsh,
+                 .patchgsh = patchgsh,
+                 .patchfsh = patchfsh,
+                 .patchctmloc = patchctmloc,
+                 .patchsizeloc = patchsizeloc,
+                 .patchtolloc = patchtolloc,
+                 .posloc = posloc,
+                 .uvloc = uvloc,
+                 .rectloc = rectloc,
+                 .radiusloc = radiusloc,
+                 .xformxloc = xformxloc,
+                 .xformyloc = xformyloc,
+                 .colorloc = colorloc,
+                 .ring = ring,
+                 .corners = corners,
+                 .mappable = GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range,
+                 .fences = GLEW_VERSION_3_2 || GLEW_ARB_sync,
+                 .atlassize = ATLAS_SIZE,
+                 .drawnmin = pgpt(INFINITY, INFINITY),
+                 .drawnmax = pgpt(-INFINITY, -INFINITY),
+                 .damagemin = pgpt(INFINITY, INFINITY),
+                 .damagemax = pgpt(-INFINITY, -INFINITY));
+}
+
+
+/*
+    Create a canvas that draws into a texture, to be drawn onto `parent`
+    with pg_canvas_draw_layer(). It starts out transparent and is
+    antialiased analytically because it has no multisampling.
+    It shares the parent's programs, so it must be freed first.
+*/
+Pg*
+pg_canvas_new_layer(Pg *parent, unsigned width, unsigned height)
+{
+    if (!parent || parent->v != &methods || !width || !height)
+        return 0;
+
+    if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object)
+        return 0;
+
+    GL      *p = GL(parent);
+    GLuint  fbo, texture, color, stencil, ring;
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    if (!new_target(texture, (GLsizei) width, (GLsizei) height,
+                    &fbo, &color, &stencil))
+    {
+        glDeleteTextures(1, &texture);
+        return 0;
+    }
+
+    glGenBuffers(1, &ring);
+
+    GL *gl = pgnew(GL,
+                   _pg_canvas_init(&methods, width, height),
+                   .parent = p,
+                   .fbo = fbo,
+                   .texture = texture,
+                   .stencil = stencil,
+                   .vsh = p->vsh,
+                   .curveprog = p->curveprog,
+                   .curvefsh = p->curvefsh,
+                   .curvectmloc = p->curvectmloc,
+                   .patchprog = p->patchprog,
+                   .patchvsh = p->patchvsh,
+                   .patchgsh = p->patchgsh,
+                   .patchfsh = p->patchfsh,
+                   .patchctmloc = p->patchctmloc,
+                   .patchsizeloc = p->patchsizeloc,
+                   .patchtolloc = p->patchtolloc,
+                   .layerprog = p->layerprog,
+                   .layerfsh = p->layerfsh,
+                   .layerctmloc = p->layerctmloc,
+                   .opacityloc = p->opacityloc,
+                   .posloc = p->posloc,
+                   .uvloc = p->uvloc,
+                   .rectloc = p->rectloc,
+                   .radiusloc = p->radiusloc,
+                   .xformxloc = p->xformxloc,
+                   .xformyloc = p->xformyloc,
+                   .colorloc = p->colorloc,
+                   .ring = ring,
+                   .corners = p->corners,
+                   .mappable = p->mappable,
+                   .fences = p->fences,
+                   .atlassize = ATLAS_SIZE,
+                   .analytic = true,
+                   .drawnmin = pgpt(INFINITY, INFINITY),
+                   .drawnmax = pgpt(-INFINITY, -INFINITY),
+                   .damagemin = pgpt(INFINITY, INFINITY),
+                   .damagemax = pgpt(-INFINITY, -INFINITY));
+
+    for (unsigned i = 0; i < NVARIANTS; i++)
+        gl->progs[i] = (Program) {
+            .prog = p->progs[i].prog,
+            .ctmloc = p->progs[i].ctmloc,
+            .paintloc = p->progs[i].paintloc,
+        };
+
+    size_target(gl, (GLsizei) width, (GLsizei) height);
+    return (Pg*) gl;
+}
+
+
+/*
+    Create a canvas that draws into a framebuffer without a window,
+    for rendering in batches with no display server. Its pixels are read
+    with pg_canvas_read_pixels(). It is antialiased analytically because
+    it has no multisampling. Offscreen canvases share one context, which
+    is made current when one is created.
+*/
+Pg*
+pg_canvas_new_offscreen(unsigned width, unsigned height)
+{
+#ifdef USE_EGL
+    if (!width || !height || !start_egl())
+        return 0;
+
+    glewInit();
+
+    GLuint  fbo, color, stencil;
+
+    if ((!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object) ||
+        !new_target(0, (GLsizei) width, (GLsizei) height, &fbo, &color, &stencil))
+    {
+        stop_egl();
+        return 0;
+    }
+
+    GL *gl = GL(pg_canvas_new_opengl(width, height));
+
+    gl->fbo = fbo;
+    gl->color = color;
+    gl->stencil = stencil;
+    gl->egl = true;
+    gl->analytic = true;
+    size_target(gl, (GLsizei) width, (GLsizei) height);
+    return (Pg*) gl;
+#else
+    (void) width;
+    (void) height;
+    return 0;
+#endif
+}
+
+
+/*
+    Draw a layer onto the canvas it was made from, transformed by the CTM
+    like a rectangle at the origin of the same size, and faded by
+    `opacity`. What is drawn is what the layer holds once everything
+    drawn on it so far is flushed.
+*/
+void
+pg_canvas_draw_layer(Pg *g, Pg *layer, float opacity)
+{
+    if (!g || g->v != &methods || !layer || layer->v != &methods)
+        return;
+
+    GL *gl = GL(g);
+    GL *lgl = GL(layer);
+
+    if (lgl->parent != gl || opacity <= 0.0f)
+        return;
+
+    flush(layer);
+
+    PgTM    ctm = g->s.ctm;
+    PgPt    a = pg_mat_apply(ctm, pgpt(0.0f, 0.0f));
+    PgPt    b = pg_mat_apply(ctm, pgpt(layer->sx, 0.0f));
+    PgPt    c = pg_mat_apply(ctm, pgpt(0.0f, layer->sy));
+    PgPt    d = pg_mat_apply(ctm, pgpt(layer->sx, layer->sy));
+
+    gl->quads = reserve(gl->quads, &gl->maxquads, gl->nquads + 6, 4 * sizeof *gl->quads);
+
+    // Textures are upside down.
+    GLfloat *q = gl->quads + gl->nquads * 4;
+    memcpy(q, (GLfloat[]) { a.x, a.y, 0, 1,   b.x, b.y, 1, 1,   c.x, c.y, 0, 0,
+                            b.x, b.y, 1, 1,   c.x, c.y, 0, 0,   d.x, d.y, 1, 0 },
+           24 * sizeof *q);
+
+    // Layers have no paint.
+    Cmd *cmd = record(g, CMD_LAYER, 0);
+
+    cmd->first = gl->nquads;
+    cmd->count = 6;
+    cmd->texture = lgl->texture;
+    cmd->opacity = fminf(opacity, 1.0f);
+    cmd->min = pgpt(fminf(fminf(a.x, b.x), fminf(c.x, d.x)),
+                    fminf(fminf(a.y, b.y), fminf(c.y, d.y)));
+    cmd->max = pgpt(fmaxf(fmaxf(a.x, b.x), fmaxf(c.x, d.x)),
+                    fmaxf(fmaxf(a.y, b.y), fmaxf(c.y, d.y)));
+    gl->nquads += 6;
+
+    lgl->pending = true;
+    lgl->drawnepoch = gl->epoch;
+}
+
+
+/*
+    Set the width and height of the texture that rasterised glyphs are
+    cached in. Zero turns the cache off so that all text is filled as
+    outlines.
+*/
+void
+pg_canvas_set_glyph_cache(Pg *g, unsigned size)
+{
+    if (!g || g->v != &methods)
+        return;
+
+    GL *gl = GL(g);
+
+    flush(g);
+    drop_glyphs(gl);
+    gl->atlassize = !size? 0: size < GLYPH_MAX? GLYPH_MAX: (int) size;
+}
+
+
+/*
+    Set the most memory that flattened paths can be cached in.
+    The cache is off until this is called with a non-zero size.
+*/
+void
+pg_canvas_set_path_cache(Pg *g, size_t max_bytes)
+{
+    if (!g || g->v != &methods)
+        return;
+
+    GL *gl = GL(g);
+
+    gl->pathcap = max_bytes;
+    while (gl->oldest && gl->pathsize > gl->pathcap)
+        evict_path(gl, gl->oldest);
+}
+
+
+/*
+    Fill curves by evaluating them on the GPU instead of flattening
+    them into line segments.
+*/
+void
+pg_canvas_set_implicit_curves(Pg *g, bool implicit)
+{
+    if (!g || g->v != &methods)
+        return;
+
+    GL(g)->implicit = implicit;
+}
+
+
+/*
+    Antialias fills and strokes by working out how much of each pixel
+    along their edges they cover, rather than by multisampling.
+*/
+void
+pg_canvas_set_analytic_antialias(Pg *g, bool analytic)
+{
+    if (!g || g->v != &methods)
+        return;
+
+    GL(g)->analytic = analytic;
+}
+
+
+/*
+    Only draw inside the rectangle until the next commit, whatever the
+    scissor is. This is for redrawing part of a target that still holds
+    the rest of an earlier frame.
+*/
+void
+pg_canvas_set_redraw_region(Pg *g, float x, float y, float sx, float sy)
+{
+    if (!g || g->v != &methods)
+        return;
+
+    GL *gl = GL(g);
+
+    // Commands already recorded are not limited.
+    flush(g);
+
+    float x0 = fmaxf(0.0f, floorf(x));
+    float y0 = fmaxf(0.0f, floorf(y));
+    float x1 = fminf(g->sx, ceilf(x + sx));
+    float y1 = fminf(g->sy, ceilf(y + sy));
+
+    gl->redraw[0] = (GLint) x0;
+    gl->redraw[1] = (GLint) (g->sy - y1);
+    gl->redraw[2] = x1 > x0? (GLint) (x1 - x0): 0;
+    gl->redraw[3] = y1 > y0? (GLint) (y1 - y0): 0;
+    gl->limited = true;
+}
+
+
+/*
+    Get the bounds of what was drawn between the last two commits.
+    Nothing was drawn if the size is zero.
+*/
+PgPt
+pg_canvas_get_damage_start(Pg *g)
+{
+    if (!g || g->v != &methods || GL(g)->damagemin.x > GL(g)->damagemax.x)
+        return pgpt(0.0f, 0.0f);
+
+    return GL(g)->damagemin;
+}
+
+
+PgPt
+pg_canvas_get_damage_size(Pg *g)
+{
+    if (!g || g->v != &methods || GL(g)->damagemin.x > GL(g)->damagemax.x)
+        return pgpt(0.0f, 0.0f);
+
+    return sub(GL(g)->damagemax, GL(g)->damagemin);
+}
+
+
+/*
+    Read a rectangle of the canvas without waiting for it to be drawn.
+    Everything recorded so far is drawn and read into a pixel buffer.
+    On a later commit, once the GL has finished, `callback` is given the
+    pixels as rows of RGBA from the top down, which are only valid during
+    the call. The pixels are null if the buffer could not be mapped.
+    Reads still pending when the canvas is freed are delivered then.
+    Layers give colours multiplied by alpha. Windows must be read before
+    they are updated, while the frame is in the back buffer.
+*/
+bool
+pg_canvas_read_pixels_async(Pg *g, float x, float y, float sx, float sy,
+                            PgPixelsCallback *callback, void *data)
+{
+    GLint rect[4];
+
+    if (!g || g->v != &methods || !callback || !read_rect(g, x, y, sx, sy, rect))
+        return false;
+
+    if (!GLEW_VERSION_2_1 && !GLEW_ARB_pixel_buffer_object)
+        return false;
+
+    GL          *gl = GL(g);
+    GLuint      pbo;
+    GLsizeiptr  size = (GLsizeiptr) rect[2] * rect[3] * 4;
+
+    if (gl->nspares)
+        pbo = gl->spares[--gl->nspares];
+    else
+        glGenBuffers(1, &pbo);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
+    read_pixels(g, rect, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    gl->reads = reserve(gl->reads, &gl->maxreads, gl->nreads + 1, sizeof *gl->reads);
+    gl->reads[gl->nreads++] = (Readback) {
+        .pbo = pbo,
+        .fence = gl->fences? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0): 0,
+        .commit = gl->commits,
+        .width = (unsigned) rect[2],
+        .height = (unsigned) rect[3],
+        .callback = callback,
+        .data = data,
+    };
+    return true;
+}
+
+
+/*
+    Read a rectangle of the canvas into `pixels`, waiting for it to be
+    drawn. There must be room for 4 bytes of RGBA for every pixel, with
+    rows from the top down. Asynchronous reads still pending are
+    delivered first.
+*/
+bool
+pg_canvas_read_pixels(Pg *g, float x, float y, float sx, float sy, uint8_t *pixels)
+{
+    GLint rect[4];
+
+    if (!g || g->v != &methods || !pixels || !read_rect(g, x, y, sx, sy, rect))
+        return false;
+
+    GL          *gl = GL(g);
+    unsigned    width = (unsigned) rect[2];
+    unsigned    height = (unsigned) rect[3];
+
+    deliver_reads(gl, true);
+
+    gl->readrows = reserve(gl->readrows, &gl->maxreadrows, width * height * 4, 1);
+    read_pixels(g, rect, gl->readrows);
+    flip_rows(pixels, gl->readrows, width, height);
+    return true;
+}
+
+
+unsigned
+pg_canvas_get_path_cache_hits(Pg *g)
+{
+    if (!g || g->v != &methods)
+        return 0;
+
+    return GL(g)->pathhits;
+}
+
+
+unsigned
+pg_canvas_get_path_cache_misses(Pg *g)
+{
+    if (!g || g->v != &methods)
+        return 0;
+
+    return GL(g)->pathmisses;
 }
 
 static const PgCanvasFunc methods = {
@@ -714,6 +4057,8 @@ static const PgCanvasFunc methods = {
     _fill_stroke,
     _set_size,
     _free,
+    _show_glyph,
+    _fill_instances,
 };
 
 #endif
@@ -13,18 +13,20 @@ struct PgSubcanvas {
 };
 
 
+/*
+    Give the parent this canvas's path and state, translated to its
+    position and clipped to its bounds. Returns the parent's own path
+    and state so they can be restored with leave().
+*/
 static
-void
-call(Pg *g, void subroutine(Pg *g))
+PgState
+enter(Pg *g, PgPath **old_path)
 {
-    if (!g || !subroutine)
-        return;
-
     PgSubcanvas     *sub = (PgSubcanvas*) g;
     Pg              *parent = sub->parent;
-    PgPath          *old_path = parent->path;
     PgState         old_state = parent->s;
 
+    *old_path = parent->path;
     parent->path = sub->_.path;
     parent->s = sub->_.s;
 
@@ -34,14 +36,37 @@ call(Pg *g, void subroutine(Pg *g))
                           sub->y + fmaxf(g->s.clip_y, 0.0f),
                           fminf(fmaxf(g->s.clip_sx, 0.0f), g->sx),
                           fminf(fmaxf(g->s.clip_sy, 0.0f), g->sy));
+    return old_state;
+}
 
-    subroutine(parent);
+
+static
+void
+leave(Pg *g, PgPath *old_path, PgState old_state)
+{
+    Pg  *parent = ((PgSubcanvas*) g)->parent;
 
     parent->path = old_path;
     parent->s = old_state;
 }
 
 
+static
+void
+call(Pg *g, void subroutine(Pg *g))
+{
+    if (!g || !subroutine)
+        return;
+
+    PgPath      *old_path;
+    PgState     old_state = enter(g, &old_path);
+
+    subroutine(((PgSubcanvas*) g)->parent);
+
+    leave(g, old_path, old_state);
+}
+
+
 static
 void
 commit(Pg *g) {
@@ -83,6 +108,58 @@ fill_stroke(Pg *g)
 }
 
 
+static
+bool
+show_glyph(Pg *g, PgFont *font, float x, float y, unsigned glyph)
+{
+    Pg  *parent = ((PgSubcanvas*) g)->parent;
+
+    if (!parent->v->show_glyph)
+        return false;
+
+    PgPath      *old_path;
+    PgState     old_state = enter(g, &old_path);
+    bool        shown = parent->v->show_glyph(parent, font, x, y, glyph);
+
+    leave(g, old_path, old_state);
+    return shown;
+}
+
+
+/*
+    The parent applies the offset of the subcanvas after the CTM, so each
+    transform is moved to apply before it instead.
+*/
+static
+bool
+fill_instances(Pg *g, const PgPath *path, const PgTM *xforms, const PgPaint **paints, unsigned n)
+{
+    PgSubcanvas *sub = (PgSubcanvas*) g;
+    Pg          *parent = sub->parent;
+
+    if (!parent->v->fill_instances)
+        return false;
+
+    PgTM        there = { 1.0f, 0.0f, 0.0f, 1.0f, sub->x, sub->y };
+    PgTM        back = { 1.0f, 0.0f, 0.0f, 1.0f, -sub->x, -sub->y };
+    PgTM        *moved = malloc(n * sizeof *moved);
+
+    if (!moved)
+        return false;
+
+    for (unsigned i = 0; i < n; i++)
+        moved[i] = pg_mat_multiply(pg_mat_multiply(back, xforms[i]), there);
+
+    PgPath      *old_path;
+    PgState     old_state = enter(g, &old_path);
+    bool        filled = parent->v->fill_instances(parent, path, moved, paints, n);
+
+    leave(g, old_path, old_state);
+    free(moved);
+    return filled;
+}
+
+
 static
 PgPt
 set_size(Pg *g, float sx, float sy)
@@ -110,6 +187,8 @@ static const PgCanvasFunc methods = {
     .fill_stroke = fill_stroke,
     .set_size = set_size,
     .free = _free,
+    .show_glyph = show_glyph,
+    .fill_instances = fill_instances,
 };
 
 
@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <pg3/pg.h>
 #include <pg3/pg-utf-8.h>
+#include <pg3/pg-internal-canvas.h>
 #include <pg3/pg-internal-font.h>
 #include <pg3/pg-internal-platform.h>
 
@@ -454,11 +455,14 @@ _pg_font_init(const PgFontFunc *v,
              float ascender,
              float descender)
 {
+    static unsigned serial;
+
     return (PgFont) {
         .v = v,
         .data = data,
         .size = size,
         .index = index,
+        .serial = ++serial,
         .sx = 1.0f,
         .sy = 1.0f,
         .nglyphs = nglyphs,
@@ -672,12 +676,27 @@ pg_canvas_trace_string(Pg *g, PgFont *font, float x, float y, const char *str)
 }
 
 
+/*
+    Draw a glyph directly if the canvas can, otherwise add its outline
+    to the path to be filled by the caller.
+*/
+static float
+show_glyph(Pg *g, PgFont *font, float x, float y, unsigned glyph)
+{
+    if (g->v && g->v->show_glyph && g->s.fill && glyph < font->nglyphs)
+        if (g->v->show_glyph(g, font, x, y, glyph))
+            return x + pg_font_measure_glyph(font, glyph);
+
+    return pg_canvas_trace_glyph(g, font, x, y, glyph);
+}
+
+
 float
 pg_canvas_show_char(Pg *g, PgFont *font, float x, float y, uint32_t codepoint)
 {
     if (!g || !font)
         return x;
-    float out_x = pg_canvas_trace_char(g, font, x, y, codepoint);
+    float out_x = show_glyph(g, font, x, y, pg_font_char_to_glyph(font, codepoint));
     pg_canvas_fill(g);
     return out_x;
 }
@@ -686,9 +705,17 @@ pg_canvas_show_char(Pg *g, PgFont *font, float x, float y, uint32_t codepoint)
 float
 pg_canvas_show_chars(Pg *g, PgFont *font, float x, float y, const char *str, size_t nbytes)
 {
-    if (!g || !font)
+    if (!g || !font || !str)
         return x;
-    float out_x = pg_canvas_trace_chars(g, font, x, y, str, nbytes);
+
+    const char  *i = str;
+    const char  *end = i + nbytes;
+    float       out_x = x;
+
+    while (i < end)
+        out_x = show_glyph(g, font, out_x, y,
+                           pg_font_char_to_glyph(font, pg_read_utf8(&i, end)));
+
     pg_canvas_fill(g);
     return out_x;
 }
@@ -697,11 +724,9 @@ pg_canvas_show_chars(Pg *g, PgFont *font, float x, float y, const char *str, siz
 float
 pg_canvas_show_string(Pg *g, PgFont *font, float x, float y, const char *str)
 {
-    if (!g || !font)
+    if (!g || !font || !str)
         return x;
-    float out_x = pg_canvas_trace_string(g, font, x, y, str);
-    pg_canvas_fill(g);
-    return out_x;
+    return pg_canvas_show_chars(g, font, x, y, str, strlen(str));
 }
 
 
@@ -710,7 +735,7 @@ pg_canvas_show_glyph(Pg *g, PgFont *font, float x, float y, uint32_t glyph)
 {
     if (!g || !font)
         return x;
-    float out_x = pg_canvas_trace_glyph(g, font, x, y, glyph);
+    float out_x = show_glyph(g, font, x, y, glyph);
     pg_canvas_fill(g);
     return out_x;
 }
@@ -0,0 +1,620 @@
+/*
+    Path flattening and stroke tessellation shared by canvas backends.
+    Include after "help.geometry.h".
+
+    The points of a path are transformed and its curves evaluated in
+    batches. On x86-64, this is done with SSE2, or AVX2 if the CPU has
+    it, and elsewhere one point at a time. Every version does the same
+    arithmetic in the same order, so they give the same results.
+*/
+
+#if defined __x86_64__ && defined __GNUC__
+    #define FLATTEN_X86 1
+    #include <immintrin.h>
+#else
+    #define FLATTEN_X86 0
+#endif
+
+#define MAX_SEGMENTS    1024
+#define CLOSED          0x80000000u
+#define SUB(N)          ((N) & ~CLOSED)
+
+
+/*
+    Working space kept by each canvas between calls.
+    Arrays grow as needed and are reused, so drawing does not allocate
+    once they have reached the size of the largest path.
+*/
+typedef struct {
+    PgPt        *pts;       // Points of the path under the CTM.
+    unsigned    maxpts;
+    PgPt        *verts;
+    unsigned    maxverts;
+    unsigned    *subs;
+    unsigned    maxsubs;
+    PgPt        *tris;
+    unsigned    maxtris;
+} Scratch;
+
+
+static void*
+reserve(void *array, unsigned *max, unsigned n, size_t size)
+{
+    if (n <= *max)
+        return array;
+
+    unsigned new = *max? *max: 256;
+    while (new < n)
+        new *= 2;
+    *max = new;
+    return realloc(array, new * size);
+}
+
+
+static void
+free_scratch(Scratch *scratch)
+{
+    free(scratch->pts);
+    free(scratch->verts);
+    free(scratch->subs);
+    free(scratch->tris);
+    *scratch = (Scratch) { 0 };
+}
+
+
+static
+inline
+PgPt
+perp(PgPt p)
+{
+    return pgpt(-p.y, p.x);
+}
+
+
+static
+inline
+PgPt
+normalize(PgPt p)
+{
+    float invmag = 1.0f / sqrtf(p.x * p.x + p.y * p.y);
+    return pgpt(p.x * invmag, p.y * invmag);
+}
+
+
+static
+inline
+float
+dot(PgPt a, PgPt b)
+{
+    return a.x * b.x + a.y * b.y;
+}
+
+
+/*
+    A curve as a polynomial a t^3 + b t^2 + c t + d in each coordinate.
+    Quadratics have no cubic term.
+*/
+typedef struct {
+    PgPt    a, b, c, d;
+} Poly;
+
+
+static
+inline
+Poly
+poly3(PgPt a, PgPt b, PgPt c)
+{
+    return (Poly) {
+        .a = pgpt(0.0f, 0.0f),
+        .b = pgpt(a.x - 2.0f * b.x + c.x, a.y - 2.0f * b.y + c.y),
+        .c = pgpt(2.0f * (b.x - a.x), 2.0f * (b.y - a.y)),
+        .d = a,
+    };
+}
+
+
+static
+inline
+Poly
+poly4(PgPt a, PgPt b, PgPt c, PgPt d)
+{
+    return (Poly) {
+        .a = pgpt(d.x - a.x + 3.0f * (b.x - c.x), d.y - a.y + 3.0f * (b.y - c.y)),
+        .b = pgpt(3.0f * (a.x - 2.0f * b.x + c.x), 3.0f * (a.y - 2.0f * b.y + c.y)),
+        .c = pgpt(3.0f * (b.x - a.x), 3.0f * (b.y - a.y)),
+        .d = a,
+    };
+}
+
+
+/*
+    Batch operations of the flattener, picked for the CPU.
+    transform() applies the CTM to points in place.
+    evaluate() writes the points at t = i/n for i from `first` up to,
+    but not including, `n`, starting at `out[0]`.
+*/
+typedef struct {
+    void    (*transform)(PgTM ctm, PgPt *pts, unsigned n);
+    void    (*evaluate)(PgPt *out, const Poly *poly, unsigned first, unsigned n);
+} FlattenFunc;
+
+
+static void
+transform_scalar(PgTM ctm, PgPt *pts, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+        pts[i] = pgpt(ctm.a * pts[i].x + ctm.c * pts[i].y + ctm.e,
+                      ctm.b * pts[i].x + ctm.d * pts[i].y + ctm.f);
+}
+
+
+static void
+evaluate_scalar(PgPt *out, const Poly *poly, unsigned first, unsigned n)
+{
+    float   h = 1.0f / (float) n;
+
+    for (unsigned i = first; i < n; i++) {
+        float t = (float) i * h;
+        *out++ = pgpt(((poly->a.x * t + poly->b.x) * t + poly->c.x) * t + poly->d.x,
+                      ((poly->a.y * t + poly->b.y) * t + poly->c.y) * t + poly->d.y);
+    }
+}
+
+
+#if FLATTEN_X86
+static void
+transform_sse2(PgTM ctm, PgPt *pts, unsigned n)
+{
+    __m128      mx = _mm_setr_ps(ctm.a, ctm.b, ctm.a, ctm.b);
+    __m128      my = _mm_setr_ps(ctm.c, ctm.d, ctm.c, ctm.d);
+    __m128      m = _mm_setr_ps(ctm.e, ctm.f, ctm.e, ctm.f);
+    unsigned    i = 0;
+
+    for ( ; i + 2 <= n; i += 2) {
+        __m128 p = _mm_loadu_ps(&pts[i].x);
+        __m128 x = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 1, 1));
+        _mm_storeu_ps(&pts[i].x,
+                      _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, mx), _mm_mul_ps(y, my)), m));
+    }
+    transform_scalar(ctm, pts + i, n - i);
+}
+
+
+static void
+evaluate_sse2(PgPt *out, const Poly *poly, unsigned first, unsigned n)
+{
+    __m128      h = _mm_set1_ps(1.0f / (float) n);
+    __m128i     lanes = _mm_setr_epi32(0, 1, 2, 3);
+    unsigned    i = first;
+
+    for ( ; i + 4 <= n; i += 4, out += 4) {
+        __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32((int) i), lanes)), h);
+        __m128 x = _mm_set1_ps(poly->a.x);
+        __m128 y = _mm_set1_ps(poly->a.y);
+        x = _mm_add_ps(_mm_mul_ps(x, t), _mm_set1_ps(poly->b.x));
+        y = _mm_add_ps(_mm_mul_ps(y, t), _mm_set1_ps(poly->b.y));
+        x = _mm_add_ps(_mm_mul_ps(x, t), _mm_set1_ps(poly->c.x));
+        y = _mm_add_ps(_mm_mul_ps(y, t), _mm_set1_ps(poly->c.y));
+        x = _mm_add_ps(_mm_mul_ps(x, t), _mm_set1_ps(poly->d.x));
+        y = _mm_add_ps(_mm_mul_ps(y, t), _mm_set1_ps(poly->d.y));
+        _mm_storeu_ps(&out[0].x, _mm_unpacklo_ps(x, y));
+        _mm_storeu_ps(&out[2].x, _mm_unpackhi_ps(x, y));
+    }
+    evaluate_scalar(out, poly, i, n);
+}
+
+
+__attribute__((target("avx2")))
+static void
+transform_avx2(PgTM ctm, PgPt *pts, unsigned n)
+{
+    __m256      mx = _mm256_setr_ps(ctm.a, ctm.b, ctm.a, ctm.b, ctm.a, ctm.b, ctm.a, ctm.b);
+    __m256      my = _mm256_setr_ps(ctm.c, ctm.d, ctm.c, ctm.d, ctm.c, ctm.d, ctm.c, ctm.d);
+    __m256      m = _mm256_setr_ps(ctm.e, ctm.f, ctm.e, ctm.f, ctm.e, ctm.f, ctm.e, ctm.f);
+    unsigned    i = 0;
+
+    for ( ; i + 4 <= n; i += 4) {
+        __m256 p = _mm256_loadu_ps(&pts[i].x);
+        __m256 x = _mm256_moveldup_ps(p);
+        __m256 y = _mm256_movehdup_ps(p);
+        _mm256_storeu_ps(&pts[i].x,
+                         _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, mx),
+                                                     _mm256_mul_ps(y, my)),
+                                       m));
+    }
+
+    // Code without VEX prefixes is slow while the upper halves are in use.
+    _mm256_zeroupper();
+    transform_scalar(ctm, pts + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void
+evaluate_avx2(PgPt *out, const Poly *poly, unsigned first, unsigned n)
+{
+    __m256      h = _mm256_set1_ps(1.0f / (float) n);
+    __m256i     lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    unsigned    i = first;
+
+    for ( ; i + 8 <= n; i += 8, out += 8) {
+        __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32((int) i), lanes)), h);
+        __m256 x = _mm256_set1_ps(poly->a.x);
+        __m256 y = _mm256_set1_ps(poly->a.y);
+        x = _mm256_add_ps(_mm256_mul_ps(x, t), _mm256_set1_ps(poly->b.x));
+        y = _mm256_add_ps(_mm256_mul_ps(y, t), _mm256_set1_ps(poly->b.y));
+        x = _mm256_add_ps(_mm256_mul_ps(x, t), _mm256_set1_ps(poly->c.x));
+        y = _mm256_add_ps(_mm256_mul_ps(y, t), _mm256_set1_ps(poly->c.y));
+        x = _mm256_add_ps(_mm256_mul_ps(x, t), _mm256_set1_ps(poly->d.x));
+        y = _mm256_add_ps(_mm256_mul_ps(y, t), _mm256_set1_ps(poly->d.y));
+
+        // Unpacking works within each half, leaving points 0,1,4,5 and 2,3,6,7.
+        __m256 lo = _mm256_unpacklo_ps(x, y);
+        __m256 hi = _mm256_unpackhi_ps(x, y);
+        _mm256_storeu_ps(&out[0].x, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(&out[4].x, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    _mm256_zeroupper();
+    evaluate_sse2(out, poly, i, n);
+}
+
+
+static const FlattenFunc flatten_sse2 = { transform_sse2, evaluate_sse2 };
+static const FlattenFunc flatten_avx2 = { transform_avx2, evaluate_avx2 };
+#else
+static const FlattenFunc flatten_scalar = { transform_scalar, evaluate_scalar };
+#endif
+
+
+// Use the widest batches the CPU has.
+static const FlattenFunc*
+flatten_func(void)
+{
+    static const FlattenFunc *func;
+
+    if (!func) {
+#if FLATTEN_X86
+        __builtin_cpu_init();
+        func = __builtin_cpu_supports("avx2")? &flatten_avx2: &flatten_sse2;
+#else
+        func = &flatten_scalar;
+#endif
+    }
+    return func;
+}
+
+
+/*
+    Flatten path into line segments in `scratch->verts`.
+    If `sub[i]` is the start of a subpath, `sub[i+1]` is the exclusive end.
+    `sub[nsubs]` holds the total number of vertices.
+    If a path is closed, the `CLOSED` bit is set on the start index.
+    Each curve is split into as many equal steps as Wang's formula says
+    it needs, so exactly that much room is made for it, and the ends of
+    the steps are evaluated in batches. The last is exactly the end.
+*/
+static void
+flatten(Pg *g,
+        Scratch *scratch,
+        unsigned *pnverts,
+        unsigned *pnsubs)
+{
+    const FlattenFunc *func = flatten_func();
+    PgPt        *verts = scratch->verts;
+    unsigned    *subs = scratch->subs;
+    PgPt        *pts = reserve(scratch->pts, &scratch->maxpts,
+                               3 * g->path->nparts, sizeof *pts);
+    unsigned    nverts = 0;
+    unsigned    nsubs = 0;
+    unsigned    npts = 0;
+    PgTM        ctm = g->s.ctm;
+    PgPt        home = pg_mat_apply(ctm, pgpt(0.0f, 0.0f));
+    PgPt        cur = home;
+    PgPath      path = *g->path;
+    float       tolerance = tolerance_of(g->s.flatness);
+
+    // Transform all the points at once.
+    for (unsigned i = 0; i < path.nparts; i++) {
+        unsigned n = path.parts[i].type == PG_PART_CURVE4? 3:
+                     path.parts[i].type == PG_PART_CURVE3? 2:
+                     path.parts[i].type == PG_PART_CLOSE? 0:
+                     1;
+        memcpy(pts + npts, path.parts[i].pt, n * sizeof *pts);
+        npts += n;
+    }
+    func->transform(ctm, pts, npts);
+    scratch->pts = pts;
+
+    for (unsigned i = 0; i < path.nparts; i++) {
+        verts = reserve(verts, &scratch->maxverts, nverts + 1, sizeof *verts);
+        subs = reserve(subs, &scratch->maxsubs, nsubs + 2, sizeof *subs);
+
+        switch (path.parts[i].type) {
+        case PG_PART_MOVE:
+            cur = home = verts[nverts++] = *pts++;
+            subs[nsubs++] = nverts - 1;
+            break;
+        case PG_PART_LINE:
+            cur = verts[nverts++] = *pts++;
+            break;
+        case PG_PART_CURVE3:
+            {
+                Poly        poly = poly3(cur, pts[0], pts[1]);
+                unsigned    n = segments3(cur, pts[0], pts[1], tolerance, MAX_SEGMENTS);
+
+                verts = reserve(verts, &scratch->maxverts, nverts + n, sizeof *verts);
+                func->evaluate(verts + nverts, &poly, 1, n);
+                nverts += n;
+                cur = verts[nverts - 1] = pts[1];
+                pts += 2;
+            }
+            break;
+        case PG_PART_CURVE4:
+            {
+                Poly        poly = poly4(cur, pts[0], pts[1], pts[2]);
+                unsigned    n = segments4(cur, pts[0], pts[1], pts[2], tolerance, MAX_SEGMENTS);
+
+                verts = reserve(verts, &scratch->maxverts, nverts + n, sizeof *verts);
+                func->evaluate(verts + nverts, &poly, 1, n);
+                nverts += n;
+                cur = verts[nverts - 1] = pts[2];
+                pts += 3;
+            }
+            break;
+        case PG_PART_CLOSE:
+            verts[nverts++] = cur = home;
+            if (nsubs)
+                subs[nsubs - 1] |= CLOSED;
+            break;
+        }
+    }
+    subs = reserve(subs, &scratch->maxsubs, nsubs + 1, sizeof *subs);
+    subs[nsubs] = nverts;
+    scratch->verts = verts;
+    scratch->subs = subs;
+    *pnverts = nverts;
+    *pnsubs = nsubs;
+}
+
+
+/*
+    Whether the join of directions `u` and `v` is too sharp to mitre.
+    It is judged the same way from either side so that the segments on
+    both sides agree.
+*/
+static inline bool
+bevelled(PgPt u, PgPt v)
+{
+    PgPt n = normalize(add(u, v));
+    return !(dot(n, u) + dot(n, v) >= 2.0f / PG_MITER_LIMIT);
+}
+
+
+/*
+    Offset from a join of directions `u` and `v` to the side of a segment
+    going in `seg`: to the corner of the mitre, or square across the
+    segment when the join is bevelled.
+*/
+static inline PgPt
+corner(PgPt w, PgPt u, PgPt v, PgPt seg)
+{
+    if (bevelled(u, v))
+        return mul(perp(seg), w);
+
+    PgPt n = normalize(add(u, v));
+    return mul(perp(n), scale_pt(w, 1.0f / dot(n, seg)));
+}
+
+
+// Draw the line segment p1-p2 considering the angle of p0-p1 and p2-p3.
+static inline unsigned
+miter(PgPt w,
+      PgPt p0,
+      PgPt p1,
+      PgPt p2,
+      PgPt p3,
+      PgPt *out,
+      unsigned n)
+{
+    PgPt vp = normalize(sub(p1, p0));
+    PgPt vc = normalize(sub(p2, p1));
+    PgPt vn = normalize(sub(p3, p2));
+    PgPt ci = corner(w, vp, vc, vc);
+    PgPt co = corner(w, vc, vn, vc);
+    PgPt a = sub(p1, ci);
+    PgPt b = add(p1, ci);
+    PgPt c = sub(p2, co);
+    PgPt d = add(p2, co);
+    out[n++] = a, out[n++] = b, out[n++] = c;
+    out[n++] = b, out[n++] = c, out[n++] = d;
+    return n;
+}
+
+
+/*
+    Fill in the join at p1 if it is too sharp to mitre. The segments on
+    either side end square there, so this goes from the end of one to the
+    start of the other, which covers the bevel on the outside.
+*/
+static inline unsigned
+bevel(PgPt w,
+      PgPt p0,
+      PgPt p1,
+      PgPt p2,
+      PgPt *out,
+      unsigned n)
+{
+    PgPt vp = normalize(sub(p1, p0));
+    PgPt vc = normalize(sub(p2, p1));
+
+    if (!bevelled(vp, vc))
+        return n;
+
+    PgPt a = sub(p1, mul(perp(vp), w));
+    PgPt b = add(p1, mul(perp(vp), w));
+    PgPt c = sub(p1, mul(perp(vc), w));
+    PgPt d = add(p1, mul(perp(vc), w));
+    out[n++] = a, out[n++] = b, out[n++] = c;
+    out[n++] = b, out[n++] = c, out[n++] = d;
+    return n;
+}
+
+
+static inline unsigned
+startcap(PgPt w,
+         PgPt cap,
+         PgPt p1,
+         PgPt p2,
+         PgPt p3,
+         PgPt *out,
+         unsigned n)
+{
+    PgPt vc = normalize(sub(p2, p1));
+    PgPt vn = normalize(sub(p3, p2));
+    PgPt co = corner(w, vc, vn, vc);
+    PgPt a = sub(sub(p1, mul(perp(vc), w)), mul(vc, cap));
+    PgPt b = sub(add(p1, mul(perp(vc), w)), mul(vc, cap));
+    PgPt c = sub(p2, co);
+    PgPt d = add(p2, co);
+    out[n++] = a, out[n++] = b, out[n++] = c;
+    out[n++] = b, out[n++] = c, out[n++] = d;
+    return n;
+}
+
+
+static inline unsigned
+endcap(PgPt w,
+       PgPt cap,
+       PgPt p0,
+       PgPt p1,
+       PgPt p2,
+       PgPt *out,
+       unsigned n)
+{
+    PgPt vp = normalize(sub(p1, p0));
+    PgPt vc = normalize(sub(p2, p1));
+    PgPt ci = corner(w, vp, vc, vc);
+    PgPt a = sub(p1, ci);
+    PgPt b = add(p1, ci);
+    PgPt c = add(sub(p2, mul(perp(vc), w)), mul(vc, cap));
+    PgPt d = add(add(p2, mul(perp(vc), w)), mul(vc, cap));
+    out[n++] = a, out[n++] = b, out[n++] = c;
+    out[n++] = b, out[n++] = c, out[n++] = d;
+    return n;
+}
+
+
+/*
+    Tessellate flattened subpaths into a list of triangles that cover
+    the stroke. Joins longer than PG_MITER_LIMIT half-widths are bevelled. The result is put in `scratch->tris` and its length in
+    `*pn`. The vertices may not be in `scratch`.
+*/
+static PgPt*
+stroke_triangles(Pg *g,
+                 Scratch *scratch,
+                 const PgPt *verts,
+                 unsigned nverts,
+                 const unsigned *subs,
+                 unsigned nsubs,
+                 unsigned *pn)
+{
+    // Line width is not in device coordinates, so scale it with CTM.
+    PgTM    strokectm = { g->s.ctm.a, g->s.ctm.b, g->s.ctm.c, g->s.ctm.d, 0.0f, 0.0f };
+    float   lw = 0.5f * g->s.line_width;
+    PgPt    w = pg_mat_apply(strokectm, pgpt(lw, lw));
+
+    PgPt    cap = g->s.line_cap == PG_BUTT_CAP? pgpt(0.0f, 0.0f):
+                  g->s.line_cap == PG_SQUARE_CAP? w:
+                  pgpt(0.0f, 0.0f);
+
+
+    // Construct each subpath.
+
+    PgPt        *final = reserve(scratch->tris, &scratch->maxtris, 12 * nverts, sizeof *final);
+    unsigned    nfinal = 0;
+
+    scratch->tris = final;
+
+    for (unsigned s = 0; s < nsubs; s++) {
+        bool        closed = subs[s] & CLOSED;
+        unsigned    start = SUB(subs[s]);
+        unsigned    end = SUB(subs[s + 1]);
+
+        if (closed) {
+            // There are no caps on this line.
+            end -= 1;
+            nfinal = miter(w,
+                            verts[end - 1], verts[start],
+                            verts[start + 1], verts[start + 2],
+                            final, nfinal);
+            nfinal = bevel(w,
+                            verts[start], verts[start + 1], verts[start + 2],
+                            final, nfinal);
+
+            for (unsigned i = start + 1; i + 2 <= end; i++) {
+                nfinal = miter(w,
+                                verts[i - 1], verts[i],
+                                verts[i + 1], verts[i + 2],
+                                final, nfinal);
+                nfinal = bevel(w,
+                                verts[i], verts[i + 1], verts[i + 2],
+                                final, nfinal);
+            }
+
+            nfinal = miter(w,
+                            verts[end - 2], verts[end - 1],
+                            verts[start], verts[start + 1],
+                            final, nfinal);
+            nfinal = bevel(w,
+                            verts[end - 1], verts[start], verts[start + 1],
+                            final, nfinal);
+        }
+
+        else if (end - start <= 2) {
+
+            // There is only one segment.
+
+            if (end - start == 2) {
+                PgPt nv = normalize(sub(verts[start + 1], verts[start]));
+                PgPt wv = mul(perp(nv), w);
+                PgPt cv = mul(nv, cap);
+                PgPt a = sub(sub(verts[start], wv), cv);
+                PgPt b = sub(add(verts[start], wv), cv);
+                PgPt c = add(sub(verts[start + 1], wv), cv);
+                PgPt d = add(add(verts[start + 1], wv), cv);
+                final[nfinal++] = a, final[nfinal++] = b, final[nfinal++] = c;
+                final[nfinal++] = b, final[nfinal++] = c, final[nfinal++] = d;
+            }
+        }
+
+        else {
+
+            // There are multiple segments.
+
+            nfinal = startcap(w, cap,
+                                verts[start], verts[start + 1],
+                                verts[start + 2], final, nfinal);
+            nfinal = bevel(w,
+                            verts[start], verts[start + 1], verts[start + 2],
+                            final, nfinal);
+
+            for (unsigned i = start + 1; i + 2 < end; i++) {
+                nfinal = miter(w,
+                                verts[i - 1], verts[i],
+                                verts[i + 1], verts[i + 2],
+                                final, nfinal);
+                nfinal = bevel(w,
+                                verts[i], verts[i + 1], verts[i + 2],
+                                final, nfinal);
+            }
+
+            nfinal = endcap(w, cap,
+                            verts[end - 3], verts[end - 2],
+                            verts[end - 1], final, nfinal);
+        }
+    }
+
+    *pn = nfinal;
+    return final;
+}
@@ -52,61 +52,51 @@ midpoint(PgPt a, PgPt b)
 }
 
 
+/*
+    Distance in pixels that a curve may stray from what is drawn for it
+    at a given flatness. Every way of drawing curves uses this.
+*/
 static
 inline
-bool
-is_flat(PgPt a, PgPt b, PgPt c, PgPt d, float flatness)
+float
+tolerance_of(float flatness)
 {
-    float ux = 3.0f * b.x - 2.0f * a.x - d.x;
-    float uy = 3.0f * b.y - 2.0f * a.y - d.y;
-    float vx = 3.0f * c.x - 2.0f * d.x - a.x;
-    float vy = 3.0f * c.y - 2.0f * d.y - a.y;
-    ux *= ux;
-    uy *= uy;
-    vx *= vx;
-    vy *= vy;
-    if (ux < vx) ux = vx;
-    if (uy < vy) uy = vy;
-    return (ux + uy <= 16.0f * flatness * flatness);
+    return (flatness * 0.5f) * (flatness * 0.5f);
 }
 
 
+/*
+    Number of segments that keep a quadratic within `tolerance` of them,
+    by Wang's formula, at least one and at most `limit`.
+*/
 static
 inline
 unsigned
-flatten3(PgPt *out, PgPt a, PgPt b, PgPt c, float flatness, int lim)
+segments3(PgPt a, PgPt b, PgPt c, float tolerance, unsigned limit)
 {
-    if (lim == 0 || is_flat(a, b, c, c, flatness)) {
-        *out = c;
-        return 1;
-    }
-    else {
-        PgPt ab = midpoint(a, b);
-        PgPt bc = midpoint(b, c);
-        PgPt abc = midpoint(ab, bc);
-        unsigned n = flatten3(out, a, ab, abc, flatness, lim - 1);
-        return n + flatten3(out + n, abc, bc, c, flatness, lim - 1);
-    }
+    float   dx = a.x - 2.0f * b.x + c.x;
+    float   dy = a.y - 2.0f * b.y + c.y;
+    float   n = ceilf(sqrtf(0.25f * sqrtf(dx * dx + dy * dy) / tolerance));
+
+    return !(n >= 1.0f)? 1: n > (float) limit? limit: (unsigned) n;
 }
 
 
+/*
+    Number of segments that keep a cubic within `tolerance` of them,
+    by Wang's formula, at least one and at most `limit`.
+*/
 static
 inline
 unsigned
-flatten4(PgPt *out, PgPt a, PgPt b, PgPt c, PgPt d, float flatness, int lim)
+segments4(PgPt a, PgPt b, PgPt c, PgPt d, float tolerance, unsigned limit)
 {
-    if (lim == 0 || is_flat(a, b, c, d, flatness)) {
-        *out = d;
-        return 1;
-    }
-    else {
-        PgPt ab = midpoint(a, b);
-        PgPt bc = midpoint(b, c);
-        PgPt cd = midpoint(c, d);
-        PgPt abc = midpoint(ab, bc);
-        PgPt bcd = midpoint(bc, cd);
-        PgPt abcd = midpoint(abc, bcd);
-        unsigned n = flatten4(out, a, ab, abc, abcd, flatness, lim - 1);
-        return n + flatten4(out + n, abcd, bcd, cd, d, flatness, lim - 1);
-    }
+    float   d1x = a.x - 2.0f * b.x + c.x;
+    float   d1y = a.y - 2.0f * b.y + c.y;
+    float   d2x = b.x - 2.0f * c.x + d.x;
+    float   d2y = b.y - 2.0f * c.y + d.y;
+    float   m = sqrtf(fmaxf(d1x * d1x + d1y * d1y, d2x * d2x + d2y * d2y));
+    float   n = ceilf(sqrtf(0.75f * m / tolerance));
+
+    return !(n >= 1.0f)? 1: n > (float) limit? limit: (unsigned) n;
 }
@@ -0,0 +1,31 @@
+/*
+    Paint evaluation shared by canvas backends.
+*/
+
+
+// Colour at `t` along a gradient before conversion to RGB.
+static PgColor
+stopcolor(const PgPaint *paint, float t)
+{
+    unsigned    n = paint->nstops;
+    unsigned    i;
+
+    for (i = 0; i < n && t > paint->stops[i]; i++) {}
+
+    if (i == 0)
+        return paint->colors[0];
+
+    if (i == n)
+        return paint->colors[n - 1];
+
+    PgColor a = paint->colors[i - 1];
+    PgColor b = paint->colors[i];
+    float   u = (t - paint->stops[i - 1]) / (paint->stops[i] - paint->stops[i - 1]);
+
+    return (PgColor) {
+        a.u + (b.u - a.u) * u,
+        a.v + (b.v - a.v) * u,
+        a.w + (b.w - a.w) * u,
+        a.a + (b.a - a.a) * u,
+    };
+}
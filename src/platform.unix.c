@@ -2,6 +2,7 @@
 
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
@@ -87,6 +88,60 @@ _pg_file_unmap(void *ptr, size_t size)
 }
 
 
+/*
+    Return the path of `name` in the user's cache directory, creating
+    the directory if it does not exist. The result must be freed.
+*/
+char*
+_pg_cache_path(const char *name)
+{
+    char    dir[PATH_MAX + 1];
+    char    path[PATH_MAX + 1];
+
+    if (!env_path(dir, "XDG_CACHE_HOME", "pg3") &&
+        !env_path(dir, "HOME", ".cache/pg3"))
+        return 0;
+
+    // The parent may not exist either.
+    char    *slash = strrchr(dir, '/');
+    *slash = 0;
+    mkdir(dir, 0755);
+    *slash = '/';
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return 0;
+
+    if (snprintf(path, sizeof path, "%s/%s", dir, name) >= (int) sizeof path)
+        return 0;
+    return strdup(path);
+}
+
+
+/*
+    Replace the file at `path` with `data`. It is written to a temporary
+    file first so that other processes never see it half written.
+*/
+bool
+_pg_file_save(const char *path, const void *data, size_t size)
+{
+    char    tmp[PATH_MAX + 1];
+    FILE    *file;
+
+    if (snprintf(tmp, sizeof tmp, "%s.%d", path, (int) getpid()) >= (int) sizeof tmp)
+        return false;
+
+    if (!(file = fopen(tmp, "wb")))
+        return false;
+
+    bool ok = fwrite(data, 1, size, file) == size;
+
+    if (fclose(file) || !ok || rename(tmp, path) < 0) {
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+
 static
 PgPt
 xrdb_dpi(void)
@@ -1,6 +1,7 @@
 #ifdef USE_XLIB
 
 #include <ctype.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +11,7 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GL/glew.h>
 #include <GL/glx.h>
 #include <pg3/pg.h>
@@ -24,6 +26,20 @@ static PgWindow         *window;
 static EGLDisplay       egl_display;
 static EGLContext       egl_context;
 static EGLSurface       egl_surface;
+static bool             egl_buffer_age;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC egl_swap_with_damage;
+#define HISTORY 4
+/*
+    Regions are kept as x0, y0, x1, y1 in pixels.
+    `dirty` is what the next paint has to redraw and `painted` is what the
+    paint being drawn is for. `history` is what changed in each of the
+    last frames shown, newest first, to bring older back buffers up to date.
+*/
+static int              dirty[4];
+static int              painted[4];
+static bool             painting;
+static int              history[HISTORY][4];
+static unsigned         nhistory;
 #define mouse_motion_cooldown (1/60.0)
 static const int        event_mask =  ExposureMask |
                                       PointerMotionMask |
@@ -153,6 +169,19 @@ native_window(unsigned width, unsigned height, const char *title)
 }
 
 
+static
+bool
+has_extension(const char *list, const char *name)
+{
+    size_t  n = strlen(name);
+
+    for (const char *p = list; p && (p = strstr(p, name)); p += n)
+        if ((p == list || p[-1] == ' ') && (p[n] == ' ' || p[n] == 0))
+            return true;
+    return false;
+}
+
+
 static
 bool
 setup_egl(unsigned width, unsigned height, const char *title)
@@ -168,6 +197,17 @@ setup_egl(unsigned width, unsigned height, const char *title)
     egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
     eglInitialize(egl_display, NULL, NULL);
     eglChooseConfig(egl_display, attrs, &conf, 1, &nconfs);
+
+    const char *ext = eglQueryString(egl_display, EGL_EXTENSIONS);
+
+    egl_buffer_age = has_extension(ext, "EGL_EXT_buffer_age");
+    if (has_extension(ext, "EGL_KHR_swap_buffers_with_damage"))
+        egl_swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+            eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    else if (has_extension(ext, "EGL_EXT_swap_buffers_with_damage"))
+        egl_swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+            eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
     egl_context = eglCreateContext(egl_display, conf, EGL_NO_CONTEXT, NULL);
     xwindow = native_window(width, height, title);
     egl_surface = eglCreateWindowSurface(egl_display, conf, xwindow, NULL);
@@ -215,15 +255,125 @@ _pg_window_open(unsigned width, unsigned height, const char *title)
 }
 
 
+static
+bool
+empty(const int *r)
+{
+    return r[0] >= r[2] || r[1] >= r[3];
+}
+
+
+static
+void
+unite(int *r, int x0, int y0, int x1, int y1)
+{
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    if (empty(r)) {
+        r[0] = x0, r[1] = y0, r[2] = x1, r[3] = y1;
+        return;
+    }
+
+    r[0] = x0 < r[0]? x0: r[0];
+    r[1] = y0 < r[1]? y0: r[1];
+    r[2] = x1 > r[2]? x1: r[2];
+    r[3] = y1 > r[3]? y1: r[3];
+}
+
+
+// Zero if the contents of the back buffer are unknown.
+static
+unsigned
+buffer_age(void)
+{
+    EGLint  age = 0;
+
+    if (egl_context && egl_buffer_age)
+        eglQuerySurface(egl_display, egl_surface, EGL_BUFFER_AGE_EXT, &age);
+    return age;
+}
+
+
+/*
+    Limit the canvas to the dirty region and whatever else has changed
+    since the frame in the back buffer was shown. Everything else in the
+    back buffer is already right.
+*/
+static
+void
+start_paint(PgWindow *win)
+{
+    unsigned    age = buffer_age();
+    int         repair[4] = { dirty[0], dirty[1], dirty[2], dirty[3] };
+
+    if (age == 0 || age - 1 > nhistory)
+        unite(repair, 0, 0, win->width, win->height);
+    else
+        for (unsigned i = 0; i + 1 < age; i++)
+            unite(repair, history[i][0], history[i][1], history[i][2], history[i][3]);
+
+    pg_canvas_set_redraw_region(win->g,
+                                repair[0], repair[1],
+                                repair[2] - repair[0], repair[3] - repair[1]);
+
+    memcpy(painted, dirty, sizeof painted);
+    memset(dirty, 0, sizeof dirty);
+    painting = true;
+}
+
+
 void
 pg_window_update(PgWindow *win)
 {
     if (!win)
         return;
+
+    // Drawing is deferred until the canvas is committed.
+    pg_canvas_commit(win->g);
+
+    /*
+        A paint only changes its dirty region.
+        Anything else changes what was drawn, but only if the back buffer
+        held the last frame. Otherwise, the whole window is shown.
+     */
+    int     changed[4] = { 0, 0, win->width, win->height };
+
+    if (painting && !empty(painted))
+        memcpy(changed, painted, sizeof changed);
+
+    else if (!painting && buffer_age() == 1) {
+        PgPt    start = pg_canvas_get_damage_start(win->g);
+        PgPt    size = pg_canvas_get_damage_size(win->g);
+
+        if (size.x > 0.0f && size.y > 0.0f) {
+            changed[0] = (int) start.x;
+            changed[1] = (int) start.y;
+            changed[2] = (int) (start.x + size.x);
+            changed[3] = (int) (start.y + size.y);
+        }
+    }
+    painting = false;
+
+    memmove(history + 1, history, (HISTORY - 1) * sizeof *history);
+    memcpy(history[0], changed, sizeof *history);
+    if (nhistory < HISTORY)
+        nhistory++;
+
     if (!egl_context) {
         glFlush();
         glXSwapBuffers(xdisplay, xwindow);
     }
+    else if (egl_swap_with_damage) {
+        // EGL counts up from the bottom.
+        EGLint  rect[4] = {
+                    changed[0],
+                    (EGLint) win->height - changed[3],
+                    changed[2] - changed[0],
+                    changed[3] - changed[1],
+                };
+        egl_swap_with_damage(egl_display, egl_surface, rect, 1);
+    }
     else
         eglSwapBuffers(egl_display, egl_surface);
 }
@@ -238,6 +388,26 @@ pg_window_queue_update(PgWindow *win)
 }
 
 
+/*
+    Queue a paint for only part of the window. During the paint, the
+    canvas only draws in that part, and only that part is shown after.
+*/
+void
+pg_window_queue_update_region(PgWindow *win, float x, float y, float sx, float sy)
+{
+    if (!win)
+        return;
+
+    int x0 = x < 0.0f? 0: (int) x;
+    int y0 = y < 0.0f? 0: (int) y;
+    int x1 = x + sx > win->width? (int) win->width: (int) ceilf(x + sx);
+    int y1 = y + sy > win->height? (int) win->height: (int) ceilf(y + sy);
+
+    if (x0 < x1 && y0 < y1)
+        XClearArea(xdisplay, xwindow, x0, y0, x1 - x0, y1 - y0, true);
+}
+
+
 void
 pg_window_queue_dummy(PgWindow *win)
 {
@@ -351,11 +521,19 @@ pg_window_event_wait(void)
     switch (xev.type) {
 
     case Expose:
-        if (xev.xexpose.count == 0)
+        unite(dirty,
+              xev.xexpose.x,
+              xev.xexpose.y,
+              xev.xexpose.x + xev.xexpose.width,
+              xev.xexpose.y + xev.xexpose.height);
+
+        if (xev.xexpose.count == 0) {
             /*
                 Multiple exposes may come. Only post message on last expose.
              */
+            start_paint(window);
             e->any = (PgWindowEventAny) { window, PG_EVENT_PAINT };
+        }
         return e;
 
     case ConfigureNotify:
@@ -365,6 +543,7 @@ pg_window_event_wait(void)
         if (xev.xconfigure.width != sz.x || xev.xconfigure.height != sz.y) {
             window->width = xev.xconfigure.width;
             window->height = xev.xconfigure.height;
+            nhistory = 0;
             pg_canvas_set_size(window->g,
                                xev.xconfigure.width,
                                xev.xconfigure.height);